@@ -0,0 +1,225 @@
+#include "closure.h"
+#include "jit.h"
+#include "lval.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+// Times evaluation, without parsing, of generated expressions by the tree
+// walker (lval_eval, with the JIT) and by closures (lclo_eval):
+//
+//   repeated  the four shapes of bench/parallel.c with new numbers each time
+//   varied    random arithmetic, so shapes rarely repeat
+//   large     sums of 300 products, too big for the JIT
+//   mixed     arithmetic around quoted lists and errors, which the JIT skips
+//
+// usage: closure [expressions per workload]
+
+static double bench_now(void) {
+  struct timespec t;
+  clock_gettime(CLOCK_MONOTONIC, &t);
+  return t.tv_sec + t.tv_nsec / 1e9;
+}
+
+static lval *bench_num(void) { return lval_num(rand() % 100 + 1); }
+
+static lval *bench_call(char op) {
+  char sym[2] = {op, '\0'};
+  lval *v = lval_sexpr();
+  lval_add(v, lval_sym(sym));
+  return v;
+}
+
+// (+ 1 (* 2 3) (- 10 4) (/ 100 5)) and the other lines of bench/parallel.c
+static lval *bench_repeated(int k) {
+  lval *v, *a, *b;
+  switch (k % 4) {
+  case 0:
+    v = bench_call('+');
+    lval_add(v, bench_num());
+    a = bench_call('*');
+    lval_add(a, bench_num());
+    lval_add(a, bench_num());
+    lval_add(v, a);
+    a = bench_call('-');
+    lval_add(a, lval_num(1000));
+    lval_add(a, bench_num());
+    lval_add(v, a);
+    a = bench_call('/');
+    lval_add(a, lval_num(10000));
+    lval_add(a, bench_num());
+    lval_add(v, a);
+    return v;
+  case 1:
+    // (* (+ 1 2) (+ 3 (* 4 (- 5 (+ 6 (* 7 8))))))
+    a = bench_call('*');
+    lval_add(a, bench_num());
+    lval_add(a, bench_num());
+    for (int i = 0; i < 3; i++) {
+      b = bench_call("+-*"[i]);
+      lval_add(b, bench_num());
+      lval_add(b, a);
+      a = b;
+    }
+    b = bench_call('+');
+    lval_add(b, bench_num());
+    lval_add(b, a);
+    v = bench_call('*');
+    a = bench_call('+');
+    lval_add(a, bench_num());
+    lval_add(a, bench_num());
+    lval_add(v, a);
+    lval_add(v, b);
+    return v;
+  case 2:
+    // (- 42)
+    v = bench_call('-');
+    lval_add(v, bench_num());
+    return v;
+  }
+  // + 1 2 3 4 5 6 7 8 9 10
+  v = bench_call('+');
+  for (int i = 0; i < 10; i++) {
+    lval_add(v, bench_num());
+  }
+  return v;
+}
+
+// random operators and operand counts, depth levels deep
+static lval *bench_varied(int depth) {
+  if (depth == 0 || rand() % 3 == 0) {
+    return bench_num();
+  }
+  lval *v = bench_call("+-*"[rand() % 3]);
+  int n = rand() % 3 + 1;
+  for (int i = 0; i < n; i++) {
+    lval_add(v, bench_varied(depth - 1));
+  }
+  return v;
+}
+
+// (+ (* a b) (* c d) ...) with 300 products
+static lval *bench_large(void) {
+  lval *v = bench_call('+');
+  for (int i = 0; i < 300; i++) {
+    lval *p = bench_call('*');
+    lval_add(p, bench_num());
+    lval_add(p, bench_num());
+    lval_add(v, p);
+  }
+  return v;
+}
+
+// ((+ 1 2) {1 2 3}) is an error, (* 2 (+ 3 4)) is not
+static lval *bench_mixed(int k) {
+  lval *v = lval_sexpr();
+  lval *a = bench_call('+');
+  lval_add(a, bench_num());
+  lval_add(a, bench_num());
+  lval_add(v, a);
+  if (k % 2 == 0) {
+    lval *q = lval_qexpr();
+    for (int i = 0; i < 3; i++) {
+      lval_add(q, bench_num());
+    }
+    lval_add(v, q);
+    return v;
+  }
+  lval_del(v);
+  v = bench_call('*');
+  lval_add(v, bench_num());
+  a = bench_call('+');
+  lval_add(a, bench_num());
+  lval_add(a, lval_err("invalid number"));
+  lval_add(v, a);
+  return v;
+}
+
+// expressions copied ahead of evaluating them, few enough that the copies
+// are still in cache, as when the interpreter evaluates what it just read
+#define BENCH_BATCH 64
+
+// evaluate copies of xs and delete the results, summing them into check.
+// only evaluating is timed, copying is not
+static double bench_run(lval **xs, int n, int closures, unsigned long *check) {
+  lval *batch[BENCH_BATCH];
+  double t = 0;
+  *check = 0;
+  for (int i = 0; i < n; i += BENCH_BATCH) {
+    int m = n - i < BENCH_BATCH ? n - i : BENCH_BATCH;
+    for (int j = 0; j < m; j++) {
+      batch[j] = lval_copy(xs[i + j]);
+    }
+    double s = bench_now();
+    for (int j = 0; j < m; j++) {
+      lval *r = closures ? lclo_eval(batch[j]) : lval_eval(batch[j]);
+      if (r->type == LVAL_NUM) {
+        *check += r->num;
+      }
+      lval_del(r);
+    }
+    t += bench_now() - s;
+  }
+  return t;
+}
+
+static void bench_workload(const char *name, lval **xs, int n) {
+  unsigned long tree_check, closure_check;
+  double tree = 0, closure = 0;
+
+  // the first round warms up the JIT and the closure cache, the fastest of
+  // the other three counts
+  for (int r = 0; r < 4; r++) {
+    double t = bench_run(xs, n, 0, &tree_check);
+    double c = bench_run(xs, n, 1, &closure_check);
+    if (r == 1 || (r > 1 && t < tree)) {
+      tree = t;
+    }
+    if (r == 1 || (r > 1 && c < closure)) {
+      closure = c;
+    }
+  }
+
+  printf("%-10s %9.3f %9.3f %8.2f%s\n", name, tree, closure, tree / closure,
+         tree_check == closure_check ? "" : "  results differ");
+  for (int i = 0; i < n; i++) {
+    lval_del(xs[i]);
+  }
+}
+
+int main(int argc, char **argv) {
+  int n = argc > 1 ? atoi(argv[1]) : 200000;
+  lval **xs = malloc(sizeof(lval *) * n);
+  srand(1);
+
+  printf("workload     tree s closure s  speedup\n");
+
+  for (int i = 0; i < n; i++) {
+    xs[i] = bench_repeated(i);
+  }
+  bench_workload("repeated", xs, n);
+
+  for (int i = 0; i < n; i++) {
+    xs[i] = bench_varied(6);
+    if (xs[i]->type != LVAL_SEXPR) {
+      lval_del(xs[i]);
+      i--;
+    }
+  }
+  bench_workload("varied", xs, n);
+
+  for (int i = 0; i < n / 100; i++) {
+    xs[i] = bench_large();
+  }
+  bench_workload("large", xs, n / 100);
+
+  for (int i = 0; i < n; i++) {
+    xs[i] = bench_mixed(i);
+  }
+  bench_workload("mixed", xs, n);
+
+  free(xs);
+  ljit_cleanup();
+  lclo_cleanup();
+  return 0;
+}
@@ -0,0 +1,148 @@
+#include "mpc.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+// Times the grammar of main.c walked by the recursive parser against the same
+// grammar after mpc_compile, first on a generated program of shallow
+// expressions and then on a single expression nested 10, 100, 1000... deep.
+//
+// usage: compile [megabytes [depth]]
+
+#define BENCH_RUNS 3
+
+static double bench_now(void) {
+  struct timespec t;
+  clock_gettime(CLOCK_MONOTONIC, &t);
+  return t.tv_sec + t.tv_nsec / 1e9;
+}
+
+// repeat a mix of flat, nested and quoted expressions up to size bytes
+static char *bench_input(size_t size, size_t *length) {
+  static const char *lines[] = {
+      "(+ 1 (* 2 3) (- 10 4) (/ 100 5))\n",
+      "(* (+ 1 2) (+ 3 (* 4 (- 5 (+ 6 (* 7 8))))))\n",
+      "{1 2 3 (+ 4 5) {6 7 {8 9}}} (- 42)\n",
+      "+ 1 2 3 4 5 6 7 8 9 10\n",
+  };
+  int count = sizeof(lines) / sizeof(lines[0]);
+  char *data = malloc(size + 64);
+  size_t len = 0;
+  for (int i = 0; len < size; i = (i + 1) % count) {
+    size_t n = strlen(lines[i]);
+    memcpy(data + len, lines[i], n);
+    len += n;
+  }
+  data[len] = '\0';
+  *length = len;
+  return data;
+}
+
+// (+ 1 (+ 1 ... 1)) nested depth deep
+static char *bench_deep(long depth) {
+  char *data = malloc(depth * 6 + 2);
+  char *p = data;
+  for (long k = 0; k < depth; k++) {
+    memcpy(p, "(+ 1 ", 5);
+    p += 5;
+  }
+  *p++ = '1';
+  memset(p, ')', depth);
+  p[depth] = '\0';
+  return data;
+}
+
+// the grammar of main.c, ps gets its six parsers for mpc_cleanup
+static mpc_parser_t *bench_grammar(mpc_parser_t **ps, int compiled) {
+  ps[0] = mpc_new("number");
+  ps[1] = mpc_new("symbol");
+  ps[2] = mpc_new("sexpr");
+  ps[3] = mpc_new("qexpr");
+  ps[4] = mpc_new("expr");
+  ps[5] = mpc_new("lispy");
+  mpca_lang(MPCA_LANG_AST_SLICES | MPCA_LANG_AST_ARENA, "         \
+          number   : /-?[0-9]+/ ;                     \
+          symbol   : '+' | '-' | '*' | '/' ;          \
+          sexpr    : '(' <expr>* ')' ;                \
+          qexpr    : '{' <expr>* '}' ;                \
+          expr     : <number> | <symbol> | <sexpr> | <qexpr> ;  \
+          lispy    : /^/ <expr>* /$/ ;     \
+          ",
+            ps[0], ps[1], ps[2], ps[3], ps[4], ps[5]);
+  mpc_analyse(ps[5]);
+  if (compiled) {
+    mpc_compile(ps[5]);
+  }
+  return ps[5];
+}
+
+// fastest of BENCH_RUNS parses in seconds, or -1 when the parse fails
+static double bench_parse(mpc_parser_t *p, const char *data) {
+  double best = -1;
+  for (int k = 0; k < BENCH_RUNS; k++) {
+    mpc_result_t r;
+    double t = bench_now();
+    int ok = mpc_parse("bench", data, p, &r);
+    t = bench_now() - t;
+    if (!ok) {
+      mpc_err_delete(r.error);
+      return -1;
+    }
+    mpc_ast_delete(r.output);
+    if (best < 0 || t < best) {
+      best = t;
+    }
+  }
+  return best;
+}
+
+static void bench_row(const char *name, double walked, double compiled) {
+  printf("%-12s", name);
+  if (walked < 0) {
+    printf(" %10s", "error");
+  } else {
+    printf(" %10.3f", walked);
+  }
+  if (compiled < 0) {
+    printf(" %10s", "error");
+  } else {
+    printf(" %10.3f", compiled);
+  }
+  if (walked >= 0 && compiled >= 0) {
+    printf(" %8.2f", walked / compiled);
+  }
+  printf("\n");
+}
+
+int main(int argc, char **argv) {
+  size_t megabytes = argc > 1 ? strtoul(argv[1], NULL, 10) : 8;
+  long max = argc > 2 ? atol(argv[2]) : 1000000;
+
+  mpc_parser_t *walker[6], *vm[6];
+  mpc_parser_t *Walked = bench_grammar(walker, 0);
+  mpc_parser_t *Compiled = bench_grammar(vm, 1);
+
+  printf("input         walked s compiled s  speedup\n");
+
+  size_t len;
+  char *data = bench_input(megabytes << 20, &len);
+  char name[32];
+  snprintf(name, sizeof(name), "%.1f MB", len / 1048576.0);
+  // one untimed parse first, so the allocator has grown before the first row
+  bench_parse(Compiled, data);
+  bench_row(name, bench_parse(Walked, data), bench_parse(Compiled, data));
+  free(data);
+
+  for (long depth = 10; depth <= max; depth *= 10) {
+    data = bench_deep(depth);
+    snprintf(name, sizeof(name), "deep %ld", depth);
+    bench_row(name, bench_parse(Walked, data), bench_parse(Compiled, data));
+    free(data);
+  }
+
+  mpc_cleanup(6, walker[0], walker[1], walker[2], walker[3], walker[4],
+              walker[5]);
+  mpc_cleanup(6, vm[0], vm[1], vm[2], vm[3], vm[4], vm[5]);
+  return 0;
+}
@@ -0,0 +1,146 @@
+#include "mpc.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+// Times mpca_parse_parallel on a generated program of top level expressions
+// with 1, 2, 4... threads up to the number of cores, or up to the given
+// number of threads.
+//
+// Each row also cuts the input into that many parts, the way
+// mpca_parse_parallel does, and parses them one after another. The longest
+// part is what a parse on that many free cores can't go below, so the one
+// part of the first row divided by it is the speedup such a machine would
+// get at most. It leaves
+// out starting threads and sharing memory between cores, and unlike the
+// speedup column it can be measured with fewer cores than threads.
+//
+// usage: parallel [megabytes [threads]]
+
+static double bench_now(void) {
+  struct timespec t;
+  clock_gettime(CLOCK_MONOTONIC, &t);
+  return t.tv_sec + t.tv_nsec / 1e9;
+}
+
+// repeat a mix of flat, nested and quoted expressions up to size bytes
+static char *bench_input(size_t size, size_t *length) {
+  static const char *lines[] = {
+      "(+ 1 (* 2 3) (- 10 4) (/ 100 5))\n",
+      "(* (+ 1 2) (+ 3 (* 4 (- 5 (+ 6 (* 7 8))))))\n",
+      "{1 2 3 (+ 4 5) {6 7 {8 9}}} (- 42)\n",
+      "+ 1 2 3 4 5 6 7 8 9 10\n",
+  };
+  int count = sizeof(lines) / sizeof(lines[0]);
+  char *data = malloc(size + 64);
+  size_t len = 0;
+  for (int i = 0; len < size; i = (i + 1) % count) {
+    size_t n = strlen(lines[i]);
+    memcpy(data + len, lines[i], n);
+    len += n;
+  }
+  *length = len;
+  return data;
+}
+
+// the longest of n parts parsed one at a time, each cut just after the
+// first newline past an nth of the input, where every line of
+// bench_input is at bracket depth zero
+static double bench_longest_part(const char *data, size_t len, long n,
+                                 mpc_parser_t *p) {
+  double longest = 0;
+  size_t start = 0;
+  for (long m = 1; m <= n && start < len; m++) {
+    size_t end = m == n ? len : len / n * m;
+    while (end < len && data[end - 1] != '\n') {
+      end++;
+    }
+    if (end <= start) {
+      continue;
+    }
+    mpc_result_t r;
+    double t = bench_now();
+    if (mpc_nparse("bench", data + start, end - start, p, &r)) {
+      mpc_ast_delete(r.output);
+    } else {
+      mpc_err_delete(r.error);
+    }
+    t = bench_now() - t;
+    if (t > longest) {
+      longest = t;
+    }
+    start = end;
+  }
+  return longest;
+}
+
+int main(int argc, char **argv) {
+  size_t megabytes = argc > 1 ? strtoul(argv[1], NULL, 10) : 16;
+  long max = argc > 2 ? atol(argv[2]) : sysconf(_SC_NPROCESSORS_ONLN);
+  if (max < 1) {
+    max = 1;
+  }
+
+  // the grammar of main.c
+  mpc_parser_t *Number = mpc_new("number");
+  mpc_parser_t *Symbol = mpc_new("symbol");
+  mpc_parser_t *Sexpr = mpc_new("sexpr");
+  mpc_parser_t *Qexpr = mpc_new("qexpr");
+  mpc_parser_t *Expr = mpc_new("expr");
+  mpc_parser_t *Lispy = mpc_new("lispy");
+  mpca_lang(MPCA_LANG_AST_SLICES | MPCA_LANG_AST_ARENA, "         \
+          number   : /-?[0-9]+/ ;                     \
+          symbol   : '+' | '-' | '*' | '/' ;          \
+          sexpr    : '(' <expr>* ')' ;                \
+          qexpr    : '{' <expr>* '}' ;                \
+          expr     : <number> | <symbol> | <sexpr> | <qexpr> ;  \
+          lispy    : /^/ <expr>* /$/ ;     \
+          ",
+            Number, Symbol, Sexpr, Qexpr, Expr, Lispy);
+  mpc_analyse(Lispy);
+  mpc_compile(Lispy);
+
+  size_t len;
+  char *data = bench_input(megabytes << 20, &len);
+  printf("%.1f MB, %ld cores\n", len / 1048576.0,
+         sysconf(_SC_NPROCESSORS_ONLN));
+  printf("threads    parse s     MB/s  speedup   part s  at most\n");
+
+  // one untimed parse first, so the allocator has grown before the first row
+  mpc_result_t w;
+  if (mpca_parse_parallel("bench", data, len, Lispy, "(){}", 1, &w)) {
+    mpc_ast_delete(w.output);
+  } else {
+    mpc_err_delete(w.error);
+  }
+
+  double base = 0, part_base = 0;
+  for (long n = 1;; n = n * 2 < max ? n * 2 : max) {
+    mpc_result_t r;
+    double t = bench_now();
+    if (!mpca_parse_parallel("bench", data, len, Lispy, "(){}", (int)n, &r)) {
+      mpc_err_print(r.error);
+      mpc_err_delete(r.error);
+      return 1;
+    }
+    t = bench_now() - t;
+    mpc_ast_delete(r.output);
+
+    double part = bench_longest_part(data, len, n, Lispy);
+    if (n == 1) {
+      base = t;
+      part_base = part;
+    }
+    printf("%7ld %10.3f %8.1f %8.2f %8.3f %8.2f\n", n, t, len / 1048576.0 / t,
+           base / t, part, part_base / part);
+    if (n == max) {
+      break;
+    }
+  }
+
+  free(data);
+  mpc_cleanup(6, Number, Symbol, Sexpr, Qexpr, Expr, Lispy);
+  return 0;
+}
@@ -0,0 +1,427 @@
+#include "closure.h"
+#include <stdlib.h>
+#include <string.h>
+
+// Every node of an sexpression becomes a closure. Sexpressions evaluate their
+// children and are reduced with lval_eval_sexpr, the same function the
+// interpreter uses.
+//
+// Arithmetic whose operands are numbers or arithmetic again gets a num
+// function per operator, so the operator is resolved once and the whole
+// subtree runs on plain longs. The outermost one boxes the result into an
+// lval. Division by zero is the only error such a subtree can produce.
+//
+// Like the JIT, closures are built from the shape of an expression: its
+// lists with their lengths and its arithmetic operators, in preorder, with a
+// slot for every other node. So one closure tree serves every expression of
+// the same shape and is kept in a cache. Running it consumes the expression
+// in place, like the tree walker: numbers, symbols and quoted lists are the
+// values of their own nodes, and each list is reduced in its own lval.
+
+#define LCLO_CACHE_SLOTS 512
+#define LCLO_CACHE_PROBES 8
+
+#define LCLO_SEEN_SLOTS 4096
+
+// longest shape in bytes that is cached, longer ones are built for one run
+#define LCLO_CACHE_MAX_SHAPE 65536
+
+typedef struct lclo {
+  lval *(*fn)(struct lclo *c);
+  long (*num)(struct lclo *c, int *err);
+  // the node's position in preorder, which is also its slot
+  int slot;
+  // the operator of an arithmetic symbol
+  char op;
+  int argc;
+  struct lclo **args;
+} lclo;
+
+// the closures of a shape, node 0 is the root
+typedef struct {
+  lclo *nodes;
+  lclo **args;
+} lclo_tree;
+
+typedef struct {
+  unsigned char *shape;
+  int len;
+  unsigned long hash;
+  // runs since it was built
+  long uses;
+  lclo_tree tree;
+} lclo_entry;
+
+// an expression split into its shape and its nodes in preorder
+typedef struct {
+  unsigned char *shape;
+  int len;
+  int cap;
+  lval **nodes;
+  int nodes_num;
+  int nodes_cap;
+} lclo_flat;
+
+static lclo_entry lclo_cache[LCLO_CACHE_SLOTS];
+static lclo_flat lclo_expr;
+
+// hashes of shapes seen once, a shape is only cached when it comes back
+static unsigned long lclo_seen[LCLO_SEEN_SLOTS];
+
+// closures of shapes that are not cached, kept for the next one
+static lclo_tree lclo_scratch;
+static int lclo_scratch_cap;
+
+// nodes of the expression being evaluated
+static lval **lclo_slots;
+
+static lval *lclo_leaf(lclo *c) { return lclo_slots[c->slot]; }
+
+static lval *lclo_sexpr(lclo *c) {
+  lval *v = lclo_slots[c->slot];
+  for (int i = 0; i < c->argc; i++) {
+    v->cells[i] = c->args[i]->fn(c->args[i]);
+  }
+  return lval_eval_sexpr(v);
+}
+
+// the sexpression becomes the number it computes
+static lval *lclo_box(lclo *c) {
+  int err = 0;
+  long x = c->num(c, &err);
+  lval *v = lclo_slots[c->slot];
+  if (err) {
+    lval_del(v);
+    return lval_err("Division by zero!");
+  }
+  for (int i = 0; i < v->cell_count; i++) {
+    lval_del(v->cells[i]);
+  }
+  free(v->cells);
+  v->type = LVAL_NUM;
+  v->num = x;
+  return v;
+}
+
+static long lclo_num_leaf(lclo *c, int *err) {
+  (void)err;
+  return lclo_slots[c->slot]->num;
+}
+
+// args[0] is the operator, the operands follow
+#define LCLO_OPERAND(c, i, err) ((c)->args[i]->num((c)->args[i], err))
+
+static long lclo_num_add(lclo *c, int *err) {
+  long x = LCLO_OPERAND(c, 1, err);
+  for (int i = 2; i < c->argc; i++) {
+    x = lnum_add(x, LCLO_OPERAND(c, i, err));
+  }
+  return x;
+}
+
+static long lclo_num_sub(lclo *c, int *err) {
+  long x = LCLO_OPERAND(c, 1, err);
+  // a single operand is negated
+  if (c->argc == 2) {
+    return lnum_neg(x);
+  }
+  for (int i = 2; i < c->argc; i++) {
+    x = lnum_sub(x, LCLO_OPERAND(c, i, err));
+  }
+  return x;
+}
+
+static long lclo_num_mul(lclo *c, int *err) {
+  long x = LCLO_OPERAND(c, 1, err);
+  for (int i = 2; i < c->argc; i++) {
+    x = lnum_mul(x, LCLO_OPERAND(c, i, err));
+  }
+  return x;
+}
+
+static long lclo_num_div(lclo *c, int *err) {
+  long x = LCLO_OPERAND(c, 1, err);
+  for (int i = 2; i < c->argc; i++) {
+    long y = LCLO_OPERAND(c, i, err);
+    // once there is an error the value no longer matters
+    if (*err || y == 0) {
+      *err = 1;
+      return 0;
+    }
+    x = lnum_div(x, y);
+  }
+  return x;
+}
+
+// add v to the nodes and make room for its shape
+static void lclo_flatten_node(lclo_flat *f, lval *v) {
+  if (f->len + 1 + (int)sizeof(int) > f->cap) {
+    f->cap = f->cap == 0 ? 256 : f->cap * 2;
+    f->shape = realloc(f->shape, f->cap);
+  }
+  if (f->nodes_num == f->nodes_cap) {
+    f->nodes_cap = f->nodes_cap == 0 ? 64 : f->nodes_cap * 2;
+    f->nodes = realloc(f->nodes, sizeof(lval *) * f->nodes_cap);
+  }
+  f->nodes[f->nodes_num++] = v;
+}
+
+// lists are 's' and a byte of length, or 'S' and an int when longer
+static void lclo_flatten_list(lclo_flat *f, lval *v) {
+  unsigned char *p = f->shape + f->len;
+  if (v->cell_count < 255) {
+    p[0] = 's';
+    p[1] = (unsigned char)v->cell_count;
+    f->len += 2;
+  } else {
+    p[0] = 'S';
+    memcpy(p + 1, &v->cell_count, sizeof(int));
+    f->len += 1 + sizeof(int);
+  }
+}
+
+// add the cells of the sexpression v, depth lists deep, to the shape.
+// numbers are 'n', arithmetic operators themselves, other symbols 'y' and
+// anything else 'v'. returns 0 when v nests deeper than LCLO_MAX_DEPTH
+static int lclo_flatten_cells(lclo_flat *f, lval *v, int depth) {
+  for (int i = 0; i < v->cell_count; i++) {
+    lval *c = v->cells[i];
+    lclo_flatten_node(f, c);
+    unsigned char *p = f->shape + f->len;
+    switch (c->type) {
+    case LVAL_NUM:
+      *p = 'n';
+      f->len++;
+      break;
+    case LVAL_SYM:
+      *p = 'y';
+      if (c->sym[1] == '\0') {
+        switch (c->sym[0]) {
+        case '+':
+        case '-':
+        case '*':
+        case '/':
+          *p = c->sym[0];
+        }
+      }
+      f->len++;
+      break;
+    case LVAL_SEXPR:
+      lclo_flatten_list(f, c);
+      if (depth == LCLO_MAX_DEPTH || !lclo_flatten_cells(f, c, depth + 1)) {
+        return 0;
+      }
+      break;
+    default:
+      *p = 'v';
+      f->len++;
+      break;
+    }
+  }
+  return 1;
+}
+
+// split the sexpression v into its shape and its nodes in preorder
+static int lclo_flatten(lclo_flat *f, lval *v) {
+  f->len = 0;
+  f->nodes_num = 0;
+  lclo_flatten_node(f, v);
+  lclo_flatten_list(f, v);
+  return lclo_flatten_cells(f, v, 1);
+}
+
+typedef struct {
+  const unsigned char *shape;
+  int pos;
+  lclo_tree *tree;
+  int nodes;
+  int args;
+} lclo_builder;
+
+// build the closure of the node at the current position of the shape and
+// those of its cells, the shape nests at most LCLO_MAX_DEPTH deep
+static lclo *lclo_build(lclo_builder *b) {
+  lclo *c = &b->tree->nodes[b->nodes];
+  c->slot = b->nodes++;
+  c->fn = lclo_leaf;
+
+  unsigned char k = b->shape[b->pos++];
+  switch (k) {
+  case 'n':
+    c->num = lclo_num_leaf;
+    return c;
+  case 's':
+    c->argc = b->shape[b->pos++];
+    break;
+  case 'S':
+    memcpy(&c->argc, b->shape + b->pos, sizeof(int));
+    b->pos += sizeof(int);
+    break;
+  case '+':
+  case '-':
+  case '*':
+  case '/':
+    c->op = k;
+    return c;
+  default:
+    return c;
+  }
+
+  c->fn = lclo_sexpr;
+  c->args = b->tree->args + b->args;
+  b->args += c->argc;
+
+  int numeric = 1;
+  for (int i = 0; i < c->argc; i++) {
+    c->args[i] = lclo_build(b);
+    numeric = numeric && (i == 0 || c->args[i]->num != NULL);
+  }
+
+  // (op x ...) with an arithmetic operator, like lval_arith_op
+  if (!numeric || c->argc < 2) {
+    return c;
+  }
+  switch (c->args[0]->op) {
+  case '+':
+    c->num = lclo_num_add;
+    break;
+  case '-':
+    c->num = lclo_num_sub;
+    break;
+  case '*':
+    c->num = lclo_num_mul;
+    break;
+  case '/':
+    c->num = lclo_num_div;
+    break;
+  }
+  if (c->num != NULL) {
+    c->fn = lclo_box;
+  }
+  return c;
+}
+
+// build the closures of a shape into t, whose nodes must be zeroed
+static void lclo_tree_fill(lclo_tree *t, const unsigned char *shape) {
+  lclo_builder b = {shape, 0, t, 0, 0};
+  lclo_build(&b);
+}
+
+static void lclo_tree_build(lclo_tree *t, const unsigned char *shape,
+                            int nodes) {
+  t->nodes = calloc(nodes, sizeof(lclo));
+  t->args = malloc(sizeof(lclo *) * (nodes > 1 ? nodes - 1 : 1));
+  lclo_tree_fill(t, shape);
+}
+
+static void lclo_tree_free(lclo_tree *t) {
+  free(t->nodes);
+  free(t->args);
+}
+
+// FNV-1a a word at a time, folding the high bits down so that the low bits
+// used for the slot depend on all of the shape
+static unsigned long lclo_hash(unsigned char *s, int len) {
+  unsigned long h = 14695981039346656037UL;
+  unsigned long w;
+  int i = 0;
+  for (; i + (int)sizeof(w) <= len; i += sizeof(w)) {
+    memcpy(&w, s + i, sizeof(w));
+    h = (h ^ w) * 1099511628211UL;
+    h ^= h >> 29;
+  }
+  for (; i < len; i++) {
+    h = (h ^ s[i]) * 1099511628211UL;
+  }
+  return h ^ (h >> 29);
+}
+
+// find the closures of a shape. a shape seen for the second time takes a
+// free slot or the least used of the probed ones, so that shapes that do
+// not repeat are never cached
+static lclo_entry *lclo_lookup(lclo_flat *f) {
+  if (f->len > LCLO_CACHE_MAX_SHAPE) {
+    return NULL;
+  }
+  unsigned long h = lclo_hash(f->shape, f->len);
+  lclo_entry *victim = NULL;
+
+  for (int i = 0; i < LCLO_CACHE_PROBES; i++) {
+    lclo_entry *e = &lclo_cache[(h + i) % LCLO_CACHE_SLOTS];
+    if (e->shape == NULL) {
+      victim = e;
+      break;
+    }
+    if (e->hash == h && e->len == f->len &&
+        memcmp(e->shape, f->shape, f->len) == 0) {
+      e->uses++;
+      return e;
+    }
+    if (victim == NULL || e->uses < victim->uses) {
+      victim = e;
+    }
+  }
+
+  unsigned long *seen = &lclo_seen[h % LCLO_SEEN_SLOTS];
+  if (*seen != h) {
+    *seen = h;
+    return NULL;
+  }
+
+  if (victim->shape != NULL) {
+    lclo_tree_free(&victim->tree);
+    free(victim->shape);
+  }
+  victim->shape = malloc(f->len);
+  memcpy(victim->shape, f->shape, f->len);
+  victim->len = f->len;
+  victim->hash = h;
+  victim->uses = 0;
+  lclo_tree_build(&victim->tree, victim->shape, f->nodes_num);
+  return victim;
+}
+
+lval *lclo_eval(lval *v) {
+  if (v->type != LVAL_SEXPR) {
+    return v;
+  }
+  if (!lclo_flatten(&lclo_expr, v)) {
+    return NULL;
+  }
+
+  lclo_slots = lclo_expr.nodes;
+
+  lclo_entry *e = lclo_lookup(&lclo_expr);
+  if (e != NULL) {
+    return e->tree.nodes->fn(e->tree.nodes);
+  }
+
+  int nodes = lclo_expr.nodes_num;
+  if (nodes > lclo_scratch_cap) {
+    lclo_tree_free(&lclo_scratch);
+    lclo_scratch.nodes = malloc(sizeof(lclo) * nodes);
+    lclo_scratch.args = malloc(sizeof(lclo *) * nodes);
+    lclo_scratch_cap = nodes;
+  }
+  memset(lclo_scratch.nodes, 0, sizeof(lclo) * nodes);
+  lclo_tree_fill(&lclo_scratch, lclo_expr.shape);
+  return lclo_scratch.nodes->fn(lclo_scratch.nodes);
+}
+
+void lclo_cleanup(void) {
+  for (int i = 0; i < LCLO_CACHE_SLOTS; i++) {
+    lclo_entry *e = &lclo_cache[i];
+    if (e->shape != NULL) {
+      lclo_tree_free(&e->tree);
+      free(e->shape);
+    }
+    memset(e, 0, sizeof(lclo_entry));
+  }
+  free(lclo_expr.shape);
+  free(lclo_expr.nodes);
+  memset(&lclo_expr, 0, sizeof(lclo_flat));
+  memset(lclo_seen, 0, sizeof(lclo_seen));
+  lclo_tree_free(&lclo_scratch);
+  memset(&lclo_scratch, 0, sizeof(lclo_tree));
+  lclo_scratch_cap = 0;
+}
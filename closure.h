@@ -0,0 +1,20 @@
+#ifndef closure_h
+#define closure_h
+
+#include "lval.h"
+
+// deepest nesting the closure compiler accepts, evaluation recurses on the
+// C stack so anything deeper is left to lval_eval
+#define LCLO_MAX_DEPTH 4096
+
+// evaluate v by converting it into a tree of C closures, each a direct call
+// through a function pointer with its operands resolved. the closures of an
+// expression shape are cached once the shape repeats. consumes v and returns
+// the result, or returns NULL and leaves v untouched when it nests deeper
+// than LCLO_MAX_DEPTH
+lval *lclo_eval(lval *v);
+
+// release all cached closures
+void lclo_cleanup(void);
+
+#endif
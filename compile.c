@@ -0,0 +1,367 @@
+#include "compile.h"
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+// Every line of the program becomes a C function. Each list in the line is
+// numbered in preorder and becomes the temporary tN. Quoted lists are built
+// as data; other sexpressions are built from their evaluated children and
+// reduced with lval_eval_sexpr, the same function the interpreter uses.
+//
+// Arithmetic over numbers only, like (+ 1 (* 2 3)), skips the lvals: nN
+// holds the value of list N and eN is set once a division by zero happened
+// in it or below it, the only error such an expression can produce.
+
+enum { LCOMP_DATA, LCOMP_EVAL, LCOMP_NUM };
+
+void lcomp_init(lcomp *c, lbuf *out) {
+  c->out = out;
+  c->lines = 0;
+  c->kinds = NULL;
+  c->kinds_cap = 0;
+
+  lbuf_puts(out, "#include \"lval.h\"\n"
+                 "#include <limits.h>\n"
+                 "#include <stdio.h>\n");
+}
+
+static void lcomp_set_kind(lcomp *c, int id, char kind) {
+  if (id >= c->kinds_cap) {
+    c->kinds_cap = c->kinds_cap == 0 ? 64 : c->kinds_cap * 2;
+    c->kinds = realloc(c->kinds, c->kinds_cap);
+  }
+  c->kinds[id] = kind;
+}
+
+static int lcomp_is_list(lval *v) {
+  return v->type == LVAL_SEXPR || v->type == LVAL_QEXPR;
+}
+
+static char lcomp_list_kind(lval *v, char parent) {
+  if (parent == LCOMP_DATA || v->type == LVAL_QEXPR) {
+    return LCOMP_DATA;
+  }
+  return lval_arith_op(v) ? LCOMP_NUM : LCOMP_EVAL;
+}
+
+// number the lists of a line and decide how each one is compiled. an
+// arithmetic list stays arithmetic only if all its operands are numbers or
+// arithmetic lists themselves
+static void lcomp_classify(lcomp *c, lval *v) {
+  lstack s;
+  int next = 1;
+
+  lcomp_set_kind(c, 0, lcomp_list_kind(v, LCOMP_EVAL));
+  lstack_init(&s);
+  lstack_push(&s, v, NULL);
+
+  while (s.count > 0) {
+    lframe *f = lstack_top(&s);
+    int id = f->flag;
+
+    if (f->i < f->v->cell_count) {
+      lval *x = f->v->cells[f->i++];
+      if (lcomp_is_list(x)) {
+        lcomp_set_kind(c, next, lcomp_list_kind(x, c->kinds[id]));
+        lstack_push(&s, x, NULL);
+        lstack_top(&s)->flag = next++;
+      } else if (c->kinds[id] == LCOMP_NUM && f->i > 1 &&
+                 x->type != LVAL_NUM) {
+        c->kinds[id] = LCOMP_EVAL;
+      }
+      continue;
+    }
+
+    s.count--;
+    if (s.count > 0 && c->kinds[id] != LCOMP_NUM &&
+        c->kinds[lstack_top(&s)->flag] == LCOMP_NUM) {
+      c->kinds[lstack_top(&s)->flag] = LCOMP_EVAL;
+    }
+  }
+
+  lstack_free(&s);
+}
+
+static void lcomp_name(lbuf *b, char prefix, int id) {
+  lbuf_putc(b, prefix);
+  lbuf_num(b, id);
+}
+
+static void lcomp_long(lbuf *b, long x) {
+  if (x == LONG_MIN) {
+    lbuf_puts(b, "LONG_MIN");
+    return;
+  }
+  lbuf_num(b, x);
+  lbuf_putc(b, 'L');
+}
+
+// write a C string literal
+static void lcomp_str(lbuf *b, const char *s) {
+  lbuf_putc(b, '"');
+  for (; *s != '\0'; s++) {
+    unsigned char ch = (unsigned char)*s;
+    // escape ? as well so no trigraphs are formed
+    if (ch == '"' || ch == '\\' || ch == '?') {
+      lbuf_putc(b, '\\');
+      lbuf_putc(b, (char)ch);
+    } else if (ch < 32 || ch >= 127) {
+      // always three octal digits so a following digit is not swallowed
+      char *p = lbuf_reserve(b, 4);
+      p[0] = '\\';
+      p[1] = (char)('0' + (ch >> 6));
+      p[2] = (char)('0' + ((ch >> 3) & 7));
+      p[3] = (char)('0' + (ch & 7));
+      b->len += 4;
+    } else {
+      lbuf_putc(b, (char)ch);
+    }
+  }
+  lbuf_putc(b, '"');
+}
+
+// write an expression creating a number, symbol or error lval
+static void lcomp_atom(lbuf *b, lval *x) {
+  switch (x->type) {
+  case LVAL_NUM:
+    lbuf_puts(b, "lval_num(");
+    lcomp_long(b, x->num);
+    break;
+  case LVAL_SYM:
+    lbuf_puts(b, "lval_sym(");
+    lcomp_str(b, x->sym);
+    break;
+  case LVAL_ERR:
+    lbuf_puts(b, "lval_err(");
+    lcomp_str(b, x->err);
+    break;
+  }
+  lbuf_putc(b, ')');
+}
+
+static void lcomp_enter(lcomp *c, lval *v, int id) {
+  lbuf *b = c->out;
+
+  if (c->kinds[id] == LCOMP_NUM) {
+    lbuf_puts(b, "  int ");
+    lcomp_name(b, 'e', id);
+    lbuf_puts(b, " = 0;\n");
+    return;
+  }
+
+  lbuf_puts(b, "  lval *");
+  lcomp_name(b, 't', id);
+  lbuf_puts(b, v->type == LVAL_SEXPR ? " = lval_sexpr();\n" : " = lval_qexpr();\n");
+}
+
+// emit the code that hands the value of x, the child just visited, to the
+// list of frame f. id is the number of x if it is a list
+static void lcomp_consume(lcomp *c, lframe *f, lval *x, int id) {
+  lbuf *b = c->out;
+  int pid = f->flag;
+
+  if (c->kinds[pid] != LCOMP_NUM) {
+    lbuf_puts(b, "  lval_add(");
+    lcomp_name(b, 't', pid);
+    lbuf_puts(b, ", ");
+    if (lcomp_is_list(x)) {
+      lcomp_name(b, 't', id);
+    } else {
+      lcomp_atom(b, x);
+    }
+    lbuf_puts(b, ");\n");
+    return;
+  }
+
+  // the operator is part of the generated code
+  if (f->i == 1) {
+    return;
+  }
+
+  // write the operand into a scratch buffer, it may be needed twice
+  char operand[32];
+  if (lcomp_is_list(x)) {
+    lbuf_puts(b, "  ");
+    lcomp_name(b, 'e', pid);
+    lbuf_puts(b, " |= ");
+    lcomp_name(b, 'e', id);
+    lbuf_puts(b, ";\n");
+    snprintf(operand, sizeof(operand), "n%d", id);
+  } else if (x->num == LONG_MIN) {
+    strcpy(operand, "LONG_MIN");
+  } else {
+    snprintf(operand, sizeof(operand), "%ldL", x->num);
+  }
+
+  if (f->i == 2) {
+    lbuf_puts(b, "  long ");
+    lcomp_name(b, 'n', pid);
+    lbuf_puts(b, " = ");
+    lbuf_puts(b, operand);
+    lbuf_puts(b, ";\n");
+    return;
+  }
+
+  char op = f->v->cells[0]->sym[0];
+  if (op == '/' && !lcomp_is_list(x) && x->num == 0) {
+    lbuf_puts(b, "  ");
+    lcomp_name(b, 'e', pid);
+    lbuf_puts(b, " = 1;\n");
+    return;
+  }
+  if (op == '/') {
+    // stop dividing once there is an error, the value no longer matters
+    if (lcomp_is_list(x)) {
+      lbuf_puts(b, "  ");
+      lcomp_name(b, 'e', pid);
+      lbuf_puts(b, " = ");
+      lcomp_name(b, 'e', pid);
+      lbuf_puts(b, " || ");
+      lbuf_puts(b, operand);
+      lbuf_puts(b, " == 0;\n");
+    }
+    lbuf_puts(b, "  if (!");
+    lcomp_name(b, 'e', pid);
+    lbuf_puts(b, ") {\n    ");
+    lcomp_name(b, 'n', pid);
+    lbuf_puts(b, " = lnum_div(");
+    lcomp_name(b, 'n', pid);
+    lbuf_puts(b, ", ");
+    lbuf_puts(b, operand);
+    lbuf_puts(b, ");\n  }\n");
+    return;
+  }
+
+  lbuf_puts(b, "  ");
+  lcomp_name(b, 'n', pid);
+  lbuf_puts(b, op == '+' ? " = lnum_add(" : op == '-' ? " = lnum_sub(" : " = lnum_mul(");
+  lcomp_name(b, 'n', pid);
+  lbuf_puts(b, ", ");
+  lbuf_puts(b, operand);
+  lbuf_puts(b, ");\n");
+}
+
+// emit the code finishing list v. boxed is set when the parent needs an lval
+static void lcomp_leave(lcomp *c, lval *v, int id, int boxed) {
+  lbuf *b = c->out;
+
+  switch (c->kinds[id]) {
+  case LCOMP_EVAL:
+    lbuf_puts(b, "  ");
+    lcomp_name(b, 't', id);
+    lbuf_puts(b, " = lval_eval_sexpr(");
+    lcomp_name(b, 't', id);
+    lbuf_puts(b, ");\n");
+    break;
+
+  case LCOMP_NUM:
+    // a single operand is negated by -, all other operators return it
+    if (v->cell_count == 2 && v->cells[0]->sym[0] == '-') {
+      lbuf_puts(b, "  ");
+      lcomp_name(b, 'n', id);
+      lbuf_puts(b, " = lnum_neg(");
+      lcomp_name(b, 'n', id);
+      lbuf_puts(b, ");\n");
+    }
+    if (boxed) {
+      lbuf_puts(b, "  lval *");
+      lcomp_name(b, 't', id);
+      lbuf_puts(b, " = ");
+      lcomp_name(b, 'e', id);
+      lbuf_puts(b, " ? lval_err(\"Division by zero!\") : lval_num(");
+      lcomp_name(b, 'n', id);
+      lbuf_puts(b, ");\n");
+    }
+    break;
+  }
+}
+
+void lcomp_line(lcomp *c, lval *v) {
+  lbuf *b = c->out;
+
+  c->lines++;
+  lbuf_puts(b, "\nstatic void line_");
+  lbuf_num(b, c->lines);
+  lbuf_puts(b, "(void) {\n");
+
+  if (!lcomp_is_list(v)) {
+    // atoms evaluate to themselves
+    lbuf_puts(b, "  lval *t0 = ");
+    lcomp_atom(b, v);
+    lbuf_puts(b, ";\n");
+  } else {
+    lstack s;
+    int next = 1;
+
+    lcomp_classify(c, v);
+    lcomp_enter(c, v, 0);
+    lstack_init(&s);
+    lstack_push(&s, v, NULL);
+
+    while (1) {
+      lframe *f = lstack_top(&s);
+
+      if (f->i < f->v->cell_count) {
+        lval *x = f->v->cells[f->i++];
+        if (lcomp_is_list(x)) {
+          lcomp_enter(c, x, next);
+          lstack_push(&s, x, NULL);
+          lstack_top(&s)->flag = next++;
+        } else {
+          lcomp_consume(c, f, x, -1);
+        }
+        continue;
+      }
+
+      // list is complete, hand it to its parent
+      lval *x = f->v;
+      int id = f->flag;
+      s.count--;
+      if (s.count == 0) {
+        lcomp_leave(c, x, id, 1);
+        break;
+      }
+      f = lstack_top(&s);
+      lcomp_leave(c, x, id, c->kinds[f->flag] != LCOMP_NUM);
+      lcomp_consume(c, f, x, id);
+    }
+
+    lstack_free(&s);
+  }
+
+  lbuf_puts(b, "  lval_println(t0);\n"
+               "  lval_del(t0);\n"
+               "}\n");
+}
+
+void lcomp_error(lcomp *c, const char *msg) {
+  lbuf *b = c->out;
+
+  c->lines++;
+  lbuf_puts(b, "\nstatic void line_");
+  lbuf_num(b, c->lines);
+  lbuf_puts(b, "(void) { fputs(");
+  lcomp_str(b, msg);
+  lbuf_puts(b, ", stdout); }\n");
+}
+
+void lcomp_finish(lcomp *c) {
+  lbuf *b = c->out;
+
+  lbuf_puts(b, "\nint main(void) {\n");
+  // the program prints the way the translator was asked to
+  if (lval_print_mode == LWRITE_PRETTY) {
+    lbuf_puts(b, "  lval_print_mode = LWRITE_PRETTY;\n");
+  }
+  for (int i = 1; i <= c->lines; i++) {
+    lbuf_puts(b, "  line_");
+    lbuf_num(b, i);
+    lbuf_puts(b, "();\n");
+  }
+  lbuf_puts(b, "  return 0;\n}\n");
+
+  free(c->kinds);
+  c->kinds = NULL;
+  c->kinds_cap = 0;
+}
@@ -0,0 +1,28 @@
+#ifndef compile_h
+#define compile_h
+
+#include "lval.h"
+
+// ahead-of-time compiler from Lispy programs to C. the generated program
+// links against the runtime in lval.c and prints exactly what the
+// interpreter prints for the same script
+typedef struct {
+  lbuf *out;
+  int lines;
+  // how each node of the current line is compiled, indexed in preorder
+  char *kinds;
+  int kinds_cap;
+} lcomp;
+
+void lcomp_init(lcomp *c, lbuf *out);
+
+// emit code that evaluates one line and prints its result
+void lcomp_line(lcomp *c, lval *v);
+
+// emit code that prints the error for a line that failed to parse
+void lcomp_error(lcomp *c, const char *msg);
+
+// emit main() running all lines in order and release the compiler
+void lcomp_finish(lcomp *c);
+
+#endif
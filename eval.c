@@ -0,0 +1,59 @@
+#include "jit.h"
+#include "lval.h"
+
+// the tree walking evaluator, kept apart from main.c so that benchmarks can
+// link it without the parser and the REPL
+
+lval *lval_eval(lval *v) {
+  // return itself for all types other than sexpressions
+  if (v->type != LVAL_SEXPR) {
+    return v;
+  }
+
+  // hot arithmetic runs as native code, frames flag subtrees too big for it
+  int oversize;
+  lval *r = ljit_eval(v, &oversize);
+  if (r != NULL) {
+    return r;
+  }
+
+  lstack s;
+  lstack_init(&s);
+  lstack_push(&s, v, NULL);
+  lstack_top(&s)->flag = oversize;
+
+  while (1) {
+    lframe *f = lstack_top(&s);
+
+    // skip over children that evaluate to themselves
+    while (f->i < f->v->cell_count && f->v->cells[f->i]->type != LVAL_SEXPR) {
+      f->i++;
+    }
+
+    // descend into the next child sexpression
+    if (f->i < f->v->cell_count) {
+      lval *c = f->v->cells[f->i];
+      oversize = f->flag;
+      r = oversize ? NULL : ljit_eval(c, &oversize);
+      if (r != NULL) {
+        f->v->cells[f->i++] = r;
+        continue;
+      }
+      lstack_push(&s, c, NULL);
+      lstack_top(&s)->flag = oversize;
+      continue;
+    }
+
+    // all children are evaluated, reduce and hand the result to the parent
+    v = lval_eval_sexpr(f->v);
+    s.count--;
+    if (s.count == 0) {
+      break;
+    }
+    f = lstack_top(&s);
+    f->v->cells[f->i++] = v;
+  }
+
+  lstack_free(&s);
+  return v;
+}
@@ -0,0 +1,326 @@
+#include "jit.h"
+#include <stdlib.h>
+#include <string.h>
+
+// MAP_ANONYMOUS is not declared under strict ISO C, so like mpc.c's mmap
+// code the JIT is left out there
+#if defined(__x86_64__) && (defined(__unix__) || defined(__APPLE__)) &&        \
+    !defined(__STRICT_ANSI__)
+
+#include <sys/mman.h>
+
+#ifndef MAP_ANONYMOUS
+#define MAP_ANONYMOUS MAP_ANON
+#endif
+
+// Template JIT for integer arithmetic on x86-64.
+//
+// An expression like (+ 1 (* 2 3)) is flattened into its shape, a postfix
+// program of number leaves and operators, plus the list of its number
+// literals. Every shape counts its evaluations and is compiled once it gets
+// hot. The compiled code reads the literals from an argument array, so all
+// expressions of the same shape share one native function.
+//
+// The native code returns 1 on division by zero or signed overflow, and the
+// expression is then evaluated again by the interpreter. builtin_op returns
+// the division by zero error, and wraps overflow with the lnum_ helpers,
+// including LONG_MIN / -1 which lnum_div turns into LONG_MIN.
+
+#define LJIT_CACHE_SLOTS 512
+#define LJIT_CACHE_PROBES 8
+
+typedef int (*ljit_fn)(const long *args, long *out);
+
+typedef struct {
+  unsigned char *shape;
+  int len;
+  unsigned long hash;
+  int count;
+  ljit_fn fn;
+  size_t size;
+} ljit_entry;
+
+typedef struct {
+  // leaves take one byte, operators two: the operator and its operand count
+  unsigned char shape[LJIT_MAX_NODES * 2];
+  int len;
+  long args[LJIT_MAX_NODES];
+  int argc;
+} ljit_flat;
+
+typedef struct {
+  unsigned char *code;
+  int len;
+  // offsets of rel32 jumps to the failure exit
+  int fails[LJIT_MAX_NODES * 3];
+  int fails_num;
+} ljit_asm;
+
+static ljit_entry ljit_cache[LJIT_CACHE_SLOTS];
+
+// check for (op x ...) with an arithmetic operator and at most LJIT_MAX_NODES
+// cells, whose operand count then fits the byte it gets in the shape
+static int ljit_is_op(lval *v) {
+  return lval_arith_op(v) && v->cell_count <= LJIT_MAX_NODES;
+}
+
+// returns 0 when v is not pure arithmetic over numbers or is too big
+static int ljit_flatten(lval *v, ljit_flat *f, int *oversize) {
+  struct {
+    lval *v;
+    int i;
+  } stk[LJIT_MAX_NODES];
+  int top = 0;
+  int nodes = 1;
+
+  f->len = 0;
+  f->argc = 0;
+  stk[top].v = v;
+  stk[top].i = 1;
+  top++;
+
+  while (top > 0) {
+    if (stk[top - 1].i < stk[top - 1].v->cell_count) {
+      lval *c = stk[top - 1].v->cells[stk[top - 1].i++];
+      if (++nodes > LJIT_MAX_NODES) {
+        *oversize = 1;
+        return 0;
+      }
+      if (c->type == LVAL_NUM) {
+        f->shape[f->len++] = 'n';
+        f->args[f->argc++] = c->num;
+        continue;
+      }
+      if (!ljit_is_op(c)) {
+        return 0;
+      }
+      stk[top].v = c;
+      stk[top].i = 1;
+      top++;
+      continue;
+    }
+
+    // all operands emitted, emit the operator
+    v = stk[--top].v;
+    f->shape[f->len++] = v->cells[0]->sym[0];
+    f->shape[f->len++] = (unsigned char)(v->cell_count - 1);
+  }
+
+  return 1;
+}
+
+static unsigned long ljit_hash(unsigned char *s, int len) {
+  // FNV-1a
+  unsigned long h = 14695981039346656037UL;
+  for (int i = 0; i < len; i++) {
+    h = (h ^ s[i]) * 1099511628211UL;
+  }
+  return h;
+}
+
+// find the cache entry for a shape, adding it if there is room
+static ljit_entry *ljit_lookup(ljit_flat *f) {
+  unsigned long h = ljit_hash(f->shape, f->len);
+
+  for (int i = 0; i < LJIT_CACHE_PROBES; i++) {
+    ljit_entry *e = &ljit_cache[(h + i) % LJIT_CACHE_SLOTS];
+    if (e->shape == NULL) {
+      e->shape = malloc(f->len);
+      memcpy(e->shape, f->shape, f->len);
+      e->len = f->len;
+      e->hash = h;
+      e->count = 0;
+      e->fn = NULL;
+      return e;
+    }
+    if (e->hash == h && e->len == f->len &&
+        memcmp(e->shape, f->shape, f->len) == 0) {
+      return e;
+    }
+  }
+
+  return NULL;
+}
+
+static void ljit_bytes(ljit_asm *a, const char *b, int n) {
+  memcpy(a->code + a->len, b, n);
+  a->len += n;
+}
+
+static void ljit_u32(ljit_asm *a, unsigned int x) {
+  memcpy(a->code + a->len, &x, 4);
+  a->len += 4;
+}
+
+// jcc rel32 to the failure exit, patched once the exit is emitted
+static void ljit_fail_jump(ljit_asm *a, const char *jcc) {
+  ljit_bytes(a, jcc, 2);
+  a->fails[a->fails_num++] = a->len;
+  ljit_u32(a, 0);
+}
+
+// rax = rax op rcx
+static void ljit_apply(ljit_asm *a, unsigned char op) {
+  switch (op) {
+  case '+':
+    ljit_bytes(a, "\x48\x01\xC8", 3); // add rax, rcx
+    ljit_fail_jump(a, "\x0F\x80");    // jo fail
+    break;
+  case '-':
+    ljit_bytes(a, "\x48\x29\xC8", 3); // sub rax, rcx
+    ljit_fail_jump(a, "\x0F\x80");    // jo fail
+    break;
+  case '*':
+    ljit_bytes(a, "\x48\x0F\xAF\xC1", 4); // imul rax, rcx
+    ljit_fail_jump(a, "\x0F\x80");        // jo fail
+    break;
+  case '/':
+    ljit_bytes(a, "\x48\x85\xC9", 3);     // test rcx, rcx
+    ljit_fail_jump(a, "\x0F\x84");        // jz fail
+    ljit_bytes(a, "\x48\x83\xF9\xFF", 4); // cmp rcx, -1
+    ljit_bytes(a, "\x75\x13", 2);         // jne over the LONG_MIN check
+    ljit_bytes(a, "\x48\xBA", 2);         // mov rdx, LONG_MIN
+    ljit_bytes(a, "\x00\x00\x00\x00\x00\x00\x00\x80", 8);
+    ljit_bytes(a, "\x48\x39\xD0", 3); // cmp rax, rdx
+    ljit_fail_jump(a, "\x0F\x84");    // je fail
+    ljit_bytes(a, "\x48\x99", 2);     // cqo
+    ljit_bytes(a, "\x48\xF7\xF9", 3); // idiv rcx
+    break;
+  }
+}
+
+// emit int fn(const long *args, long *out) for a flattened shape
+static void ljit_assemble(ljit_asm *a, ljit_flat *f) {
+  int arg = 0;
+
+  ljit_bytes(a, "\x55\x48\x89\xE5", 4); // push rbp; mov rbp, rsp
+
+  for (int i = 0; i < f->len; i++) {
+    if (f->shape[i] == 'n') {
+      ljit_bytes(a, "\x48\x8B\x87", 3); // mov rax, [rdi + 8 * arg]
+      ljit_u32(a, 8 * arg++);
+      ljit_bytes(a, "\x50", 1); // push rax
+      continue;
+    }
+
+    unsigned char op = f->shape[i++];
+    int n = f->shape[i];
+
+    if (n == 1) {
+      // a single operand is negated by -, all other operators return it
+      if (op == '-') {
+        ljit_bytes(a, "\x58", 1);         // pop rax
+        ljit_bytes(a, "\x48\xF7\xD8", 3); // neg rax
+        ljit_fail_jump(a, "\x0F\x80");    // jo fail
+        ljit_bytes(a, "\x50", 1);         // push rax
+      }
+      continue;
+    }
+
+    // operands sit on the stack with the last one on top, fold left to right
+    ljit_bytes(a, "\x48\x8B\x84\x24", 4); // mov rax, [rsp + 8 * (n - 1)]
+    ljit_u32(a, 8 * (n - 1));
+    for (int j = 1; j < n; j++) {
+      ljit_bytes(a, "\x48\x8B\x8C\x24", 4); // mov rcx, [rsp + 8 * (n - 1 - j)]
+      ljit_u32(a, 8 * (n - 1 - j));
+      ljit_apply(a, op);
+    }
+    ljit_bytes(a, "\x48\x81\xC4", 3); // add rsp, 8 * n
+    ljit_u32(a, 8 * n);
+    ljit_bytes(a, "\x50", 1); // push rax
+  }
+
+  ljit_bytes(a, "\x58", 1);         // pop rax
+  ljit_bytes(a, "\x48\x89\x06", 3); // mov [rsi], rax
+  ljit_bytes(a, "\x31\xC0", 2);     // xor eax, eax
+  ljit_bytes(a, "\xC9\xC3", 2);     // leave; ret
+
+  // failure exit, the stack is unwound by leave
+  for (int i = 0; i < a->fails_num; i++) {
+    unsigned int rel = a->len - (a->fails[i] + 4);
+    memcpy(a->code + a->fails[i], &rel, 4);
+  }
+  ljit_bytes(a, "\xB8\x01\x00\x00\x00", 5); // mov eax, 1
+  ljit_bytes(a, "\xC9\xC3", 2);             // leave; ret
+}
+
+static int ljit_compile(ljit_entry *e, ljit_flat *f) {
+  ljit_asm a;
+  // generous upper bound on the code emitted per node, division being longest
+  a.code = malloc(LJIT_MAX_NODES * 96 + 32);
+  a.len = 0;
+  a.fails_num = 0;
+  ljit_assemble(&a, f);
+
+  // map writable, copy the code in, then flip the pages to executable
+  size_t size = (a.len + 4095) & ~(size_t)4095;
+  void *p = mmap(NULL, size, PROT_READ | PROT_WRITE,
+                 MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  if (p == MAP_FAILED) {
+    free(a.code);
+    return 0;
+  }
+  memcpy(p, a.code, a.len);
+  free(a.code);
+  if (mprotect(p, size, PROT_READ | PROT_EXEC) != 0) {
+    munmap(p, size);
+    return 0;
+  }
+
+  e->fn = (ljit_fn)p;
+  e->size = size;
+  return 1;
+}
+
+lval *ljit_eval(lval *v, int *oversize) {
+  ljit_flat f;
+  long result;
+
+  *oversize = 0;
+  if (!ljit_is_op(v) || !ljit_flatten(v, &f, oversize)) {
+    return NULL;
+  }
+
+  ljit_entry *e = ljit_lookup(&f);
+  if (e == NULL) {
+    return NULL;
+  }
+
+  if (e->fn == NULL) {
+    if (++e->count < LJIT_THRESHOLD || !ljit_compile(e, &f)) {
+      return NULL;
+    }
+  }
+
+  // errors and overflow are left to the interpreter
+  if (e->fn(f.args, &result) != 0) {
+    return NULL;
+  }
+
+  lval_del(v);
+  return lval_num(result);
+}
+
+void ljit_cleanup(void) {
+  for (int i = 0; i < LJIT_CACHE_SLOTS; i++) {
+    ljit_entry *e = &ljit_cache[i];
+    if (e->fn != NULL) {
+      munmap((void *)e->fn, e->size);
+    }
+    free(e->shape);
+    memset(e, 0, sizeof(ljit_entry));
+  }
+}
+
+#else
+
+// no native code generation on this platform, always interpret
+lval *ljit_eval(lval *v, int *oversize) {
+  (void)v;
+  *oversize = 0;
+  return NULL;
+}
+
+void ljit_cleanup(void) {}
+
+#endif
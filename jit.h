@@ -0,0 +1,22 @@
+#ifndef jit_h
+#define jit_h
+
+#include "lval.h"
+
+// number of evaluations of an expression shape before it gets compiled
+#define LJIT_THRESHOLD 8
+
+// largest expression, in nodes, that the JIT will compile
+#define LJIT_MAX_NODES 256
+
+// evaluate an arithmetic sexpression with native code once its shape is hot.
+// consumes v and returns the result, or returns NULL and leaves v untouched
+// when the interpreter has to evaluate it instead. oversize is set when v has
+// more than LJIT_MAX_NODES nodes, in which case its children are not worth
+// trying either
+lval *ljit_eval(lval *v, int *oversize);
+
+// release all compiled code
+void ljit_cleanup(void);
+
+#endif
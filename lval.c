@@ -0,0 +1,480 @@
+#include "lval.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+lval *lval_num(long x) {
+  lval *v = malloc(sizeof(lval));
+  v->type = LVAL_NUM;
+  v->num = x;
+  return v;
+}
+
+lval *lval_err(char *m) {
+  lval *v = malloc(sizeof(lval));
+  v->type = LVAL_ERR;
+  v->err = malloc(strlen(m) + 1);
+  strcpy(v->err, m);
+  return v;
+}
+
+lval *lval_sym(char *s) {
+  lval *v = malloc(sizeof(lval));
+  v->type = LVAL_SYM;
+  v->sym = malloc(strlen(s) + 1);
+  strcpy(v->sym, s);
+  return v;
+}
+
+lval *lval_sexpr(void) {
+  lval *v = malloc(sizeof(lval));
+  v->type = LVAL_SEXPR;
+  v->cell_count = 0;
+  v->cells = NULL;
+  return v;
+}
+
+lval *lval_qexpr(void) {
+  lval *v = malloc(sizeof(lval));
+  v->type = LVAL_QEXPR;
+  v->cell_count = 0;
+  v->cells = NULL;
+  return v;
+}
+
+void lstack_init(lstack *s) {
+  s->count = 0;
+  s->slots = LSTACK_MIN;
+  s->frames = s->local;
+}
+
+void lstack_free(lstack *s) {
+  if (s->frames != s->local) {
+    free(s->frames);
+  }
+}
+
+void lstack_push(lstack *s, lval *v, struct mpc_ast_t *t) {
+  if (s->count == s->slots) {
+    s->slots *= 2;
+    // spill the small on-stack buffer to the heap once it overflows
+    if (s->frames == s->local) {
+      s->frames = malloc(sizeof(lframe) * s->slots);
+      memcpy(s->frames, s->local, sizeof(lframe) * s->count);
+    } else {
+      s->frames = realloc(s->frames, sizeof(lframe) * s->slots);
+    }
+  }
+  s->frames[s->count].v = v;
+  s->frames[s->count].t = t;
+  s->frames[s->count].i = 0;
+  s->frames[s->count].flag = 0;
+  s->count++;
+}
+
+lframe *lstack_top(lstack *s) { return &s->frames[s->count - 1]; }
+
+void lval_del(lval *v) {
+  lstack s;
+  lstack_init(&s);
+  lstack_push(&s, v, NULL);
+
+  while (s.count > 0) {
+    v = s.frames[--s.count].v;
+    switch (v->type) {
+    case LVAL_NUM:
+      break;
+    case LVAL_ERR:
+      free(v->err);
+      break;
+    case LVAL_SYM:
+      free(v->sym);
+      break;
+    // queue all list elements in case of sexpression / qexpression
+    case LVAL_QEXPR:
+    case LVAL_SEXPR:
+      for (int i = 0; i < v->cell_count; i++) {
+        lstack_push(&s, v->cells[i], NULL);
+      }
+      free(v->cells);
+      break;
+    }
+    free(v);
+  }
+
+  lstack_free(&s);
+}
+
+lval *lval_add(lval *v, lval *child) {
+  v->cell_count++;
+  v->cells = realloc(v->cells, sizeof(lval *) * v->cell_count);
+  v->cells[v->cell_count - 1] = child;
+  return v;
+}
+
+// copy a single node, list cells still point at the children of v
+static lval *lval_copy_node(lval *v) {
+  lval *x = malloc(sizeof(lval));
+  x->type = v->type;
+  switch (v->type) {
+  case LVAL_NUM:
+    x->num = v->num;
+    break;
+  case LVAL_ERR:
+    x->err = malloc(strlen(v->err) + 1);
+    strcpy(x->err, v->err);
+    break;
+  case LVAL_SYM:
+    x->sym = malloc(strlen(v->sym) + 1);
+    strcpy(x->sym, v->sym);
+    break;
+  case LVAL_SEXPR:
+  case LVAL_QEXPR:
+    x->cell_count = v->cell_count;
+    x->cells = NULL;
+    if (v->cell_count > 0) {
+      x->cells = malloc(sizeof(lval *) * v->cell_count);
+      memcpy(x->cells, v->cells, sizeof(lval *) * v->cell_count);
+    }
+    break;
+  }
+  return x;
+}
+
+lval *lval_copy(lval *v) {
+  lval *x = lval_copy_node(v);
+  if (x->type != LVAL_SEXPR && x->type != LVAL_QEXPR) {
+    return x;
+  }
+
+  lstack s;
+  lstack_init(&s);
+  lstack_push(&s, x, NULL);
+
+  // replace the borrowed cells of each copied list with copies
+  while (s.count > 0) {
+    lframe *f = lstack_top(&s);
+    if (f->i == f->v->cell_count) {
+      s.count--;
+      continue;
+    }
+    lval *c = lval_copy_node(f->v->cells[f->i]);
+    f->v->cells[f->i++] = c;
+    if (c->type == LVAL_SEXPR || c->type == LVAL_QEXPR) {
+      lstack_push(&s, c, NULL);
+    }
+  }
+
+  lstack_free(&s);
+  return x;
+}
+
+lval *lval_pop(lval *v, int i) {
+  // find i-th item
+  lval *x = v->cells[i];
+
+  // shift
+  memmove(&v->cells[i], &v->cells[i + 1],
+          sizeof(lval *) * (v->cell_count - i - 1));
+
+  v->cell_count--;
+
+  // reallocate
+  v->cells = realloc(v->cells, sizeof(lval *) * v->cell_count);
+  return x;
+}
+
+lval *lval_take(lval *v, int i) {
+  lval *x = lval_pop(v, i);
+  lval_del(v);
+  return x;
+}
+
+void lbuf_init(lbuf *b, FILE *out) {
+  b->out = out;
+  b->len = 0;
+  b->cap = LBUF_FLUSH;
+  b->data = malloc(b->cap);
+}
+
+void lbuf_flush(lbuf *b) {
+  if (b->out != NULL && b->len > 0) {
+    fwrite(b->data, 1, b->len, b->out);
+    b->len = 0;
+  }
+}
+
+void lbuf_free(lbuf *b) {
+  lbuf_flush(b);
+  free(b->data);
+}
+
+// make room for n more bytes, flushing full blocks to the stream first
+char *lbuf_reserve(lbuf *b, size_t n) {
+  if (b->len + n > LBUF_FLUSH) {
+    lbuf_flush(b);
+  }
+  if (b->len + n > b->cap) {
+    while (b->len + n > b->cap) {
+      b->cap *= 2;
+    }
+    b->data = realloc(b->data, b->cap);
+  }
+  return b->data + b->len;
+}
+
+void lbuf_putc(lbuf *b, char c) {
+  *lbuf_reserve(b, 1) = c;
+  b->len++;
+}
+
+void lbuf_puts(lbuf *b, const char *s) {
+  size_t n = strlen(s);
+  memcpy(lbuf_reserve(b, n), s, n);
+  b->len += n;
+}
+
+void lbuf_indent(lbuf *b, int depth) {
+  char *p = lbuf_reserve(b, depth * 2 + 1);
+  p[0] = '\n';
+  memset(p + 1, ' ', depth * 2);
+  b->len += depth * 2 + 1;
+}
+
+// format a long two digits at a time, right to left
+void lbuf_num(lbuf *b, long x) {
+  static const char digits[] = "00010203040506070809"
+                               "10111213141516171819"
+                               "20212223242526272829"
+                               "30313233343536373839"
+                               "40414243444546474849"
+                               "50515253545556575859"
+                               "60616263646566676869"
+                               "70717273747576777879"
+                               "80818283848586878889"
+                               "90919293949596979899";
+  char tmp[24];
+  char *p = tmp + sizeof(tmp);
+  // negate in unsigned arithmetic so LONG_MIN does not overflow
+  unsigned long u = x < 0 ? 0UL - (unsigned long)x : (unsigned long)x;
+
+  while (u >= 100) {
+    unsigned long r = u % 100;
+    u /= 100;
+    p -= 2;
+    memcpy(p, &digits[r * 2], 2);
+  }
+  if (u >= 10) {
+    p -= 2;
+    memcpy(p, &digits[u * 2], 2);
+  } else {
+    *--p = (char)('0' + u);
+  }
+  if (x < 0) {
+    *--p = '-';
+  }
+
+  size_t n = tmp + sizeof(tmp) - p;
+  memcpy(lbuf_reserve(b, n), p, n);
+  b->len += n;
+}
+
+// check if a list has any list children, pretty mode breaks those over lines
+int lval_has_lists(lval *v) {
+  for (int i = 0; i < v->cell_count; i++) {
+    if (v->cells[i]->type == LVAL_SEXPR || v->cells[i]->type == LVAL_QEXPR) {
+      return 1;
+    }
+  }
+  return 0;
+}
+
+// serialize an lval into a buffer
+void lval_write(lbuf *b, lval *v, int mode) {
+  lstack s;
+  lstack_init(&s);
+
+  while (v != NULL) {
+    switch (v->type) {
+    case LVAL_NUM:
+      lbuf_num(b, v->num);
+      break;
+
+    case LVAL_ERR:
+      lbuf_puts(b, "Error: ");
+      lbuf_puts(b, v->err);
+      break;
+
+    case LVAL_SYM:
+      lbuf_puts(b, v->sym);
+      break;
+
+    // open lists and remember them
+    case LVAL_SEXPR:
+    case LVAL_QEXPR:
+      lbuf_putc(b, v->type == LVAL_SEXPR ? '(' : '{');
+      lstack_push(&s, v, NULL);
+      lstack_top(&s)->flag = mode == LWRITE_PRETTY && lval_has_lists(v);
+      break;
+    }
+
+    // close finished lists until one has a child left to write
+    v = NULL;
+    while (s.count > 0) {
+      lframe *f = lstack_top(&s);
+      if (f->i < f->v->cell_count) {
+        // no trailing space for the last element
+        if (f->i > 0 && f->flag) {
+          lbuf_indent(b, s.count);
+        } else if (f->i > 0) {
+          lbuf_putc(b, ' ');
+        }
+        v = f->v->cells[f->i++];
+        break;
+      }
+      lbuf_putc(b, f->v->type == LVAL_SEXPR ? ')' : '}');
+      s.count--;
+    }
+  }
+
+  lstack_free(&s);
+}
+
+int lval_print_mode = LWRITE_COMPACT;
+
+// one buffer for all printing to stdout, allocated on first use and flushed
+// after every value
+static lbuf lval_stdout;
+
+static lbuf *lval_stdout_buf(void) {
+  if (lval_stdout.data == NULL) {
+    lbuf_init(&lval_stdout, stdout);
+  }
+  return &lval_stdout;
+}
+
+// print an lval
+void lval_print(lval *v) {
+  lbuf *b = lval_stdout_buf();
+  lval_write(b, v, lval_print_mode);
+  lbuf_flush(b);
+}
+
+void lval_println(lval *v) {
+  lbuf *b = lval_stdout_buf();
+  lval_write(b, v, lval_print_mode);
+  lbuf_putc(b, '\n');
+  lbuf_flush(b);
+}
+
+// compute in unsigned arithmetic, where overflow is defined to wrap
+long lnum_add(long x, long y) {
+  return (long)((unsigned long)x + (unsigned long)y);
+}
+
+long lnum_sub(long x, long y) {
+  return (long)((unsigned long)x - (unsigned long)y);
+}
+
+long lnum_mul(long x, long y) {
+  return (long)((unsigned long)x * (unsigned long)y);
+}
+
+long lnum_neg(long x) { return (long)(0UL - (unsigned long)x); }
+
+// LONG_MIN / -1 is the only quotient that overflows, it wraps to LONG_MIN
+// like its negation. Callers report division by zero themselves
+long lnum_div(long x, long y) { return y == -1 ? lnum_neg(x) : x / y; }
+
+char lval_arith_op(lval *v) {
+  if (v->type != LVAL_SEXPR || v->cell_count < 2) {
+    return 0;
+  }
+  char *op = v->cells[0]->type == LVAL_SYM ? v->cells[0]->sym : NULL;
+  if (op == NULL || op[0] == '\0' || op[1] != '\0' || !strchr("+-*/", op[0])) {
+    return 0;
+  }
+  return op[0];
+}
+
+lval *builtin_op(lval *a, char *op) {
+  // check if all arguments are numbers
+  for (int i = 0; i < a->cell_count; i++) {
+    if (a->cells[i]->type != LVAL_NUM) {
+      lval_del(a);
+      return lval_err("Cannot operate on non-numbers!");
+    }
+  }
+
+  lval *x = lval_pop(a, 0);
+
+  // do negation on -
+  if ((strcmp(op, "-") == 0) && a->cell_count == 0) {
+    x->num = lnum_neg(x->num);
+  }
+
+  // reduce all remaining elements
+
+  while (a->cell_count > 0) {
+    // pop next element
+    lval *y = lval_pop(a, 0);
+
+    if (strcmp(op, "+") == 0) {
+      x->num = lnum_add(x->num, y->num);
+    }
+    if (strcmp(op, "-") == 0) {
+      x->num = lnum_sub(x->num, y->num);
+    }
+    if (strcmp(op, "*") == 0) {
+      x->num = lnum_mul(x->num, y->num);
+    }
+    if (strcmp(op, "/") == 0) {
+      if (y->num == 0) {
+        lval_del(x);
+        lval_del(y);
+        x = lval_err("Division by zero!");
+        break;
+      }
+      x->num = lnum_div(x->num, y->num);
+    }
+
+    lval_del(y);
+  }
+
+  lval_del(a);
+  return x;
+}
+
+// reduce an sexpression whose children have already been evaluated
+lval *lval_eval_sexpr(lval *v) {
+  // error checking
+  for (int i = 0; i < v->cell_count; i++) {
+    if (v->cells[i]->type == LVAL_ERR) {
+      return lval_take(v, i);
+    }
+  }
+
+  // empty expression
+  if (v->cell_count == 0) {
+    return v;
+  }
+
+  // single expression
+  if (v->cell_count == 1) {
+    return lval_take(v, 0);
+  }
+
+  // more than 1 child - take symbol first
+  lval *first = lval_pop(v, 0);
+  if (first->type != LVAL_SYM) {
+    lval_del(first);
+    lval_del(v);
+    return lval_err("S-expression doesn't start with a symbol!");
+  }
+
+  // call builtin with operator
+  lval *result = builtin_op(v, first->sym);
+  lval_del(first);
+
+  return result;
+}
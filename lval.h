@@ -0,0 +1,111 @@
+#ifndef lval_h
+#define lval_h
+
+#include <stdio.h>
+
+// the runtime in lval.c does not depend on the parser, so compiled programs
+// can link against it alone
+struct mpc_ast_t;
+
+typedef struct lval {
+  int type;
+  long num;
+  // error and symbol data
+  char *err;
+  char *sym;
+
+  // cells
+  int cell_count;
+  struct lval **cells;
+} lval;
+
+// possible lval types
+enum { LVAL_ERR, LVAL_NUM, LVAL_SYM, LVAL_SEXPR, LVAL_QEXPR };
+
+// possible error types
+enum { LERR_DIV_ZERO, LERR_BAD_OP, LERR_BAD_NUM };
+
+lval *lval_num(long x);
+lval *lval_err(char *m);
+lval *lval_sym(char *s);
+lval *lval_sexpr(void);
+lval *lval_qexpr(void);
+void lval_del(lval *v);
+lval *lval_copy(lval *v);
+
+lval *lval_add(lval *v, lval *child);
+lval *lval_pop(lval *v, int i);
+lval *lval_take(lval *v, int i);
+
+// explicit stack used by the tree walkers so that nesting depth is only
+// limited by heap memory, not by the C call stack
+#define LSTACK_MIN 32
+
+typedef struct {
+  lval *v;
+  struct mpc_ast_t *t;
+  int i;
+  int flag;
+} lframe;
+
+typedef struct {
+  int count;
+  int slots;
+  lframe *frames;
+  lframe local[LSTACK_MIN];
+} lstack;
+
+void lstack_init(lstack *s);
+void lstack_free(lstack *s);
+void lstack_push(lstack *s, lval *v, struct mpc_ast_t *t);
+lframe *lstack_top(lstack *s);
+
+// growable output buffer, handed to the stream in large blocks
+#define LBUF_FLUSH 65536
+
+typedef struct {
+  FILE *out;
+  char *data;
+  size_t len;
+  size_t cap;
+} lbuf;
+
+// output modes for the serializer, pretty puts each element of a list that
+// holds lists on its own line, indented by its depth
+enum { LWRITE_COMPACT, LWRITE_PRETTY };
+
+// pass NULL as the stream to collect the output in memory only
+void lbuf_init(lbuf *b, FILE *out);
+void lbuf_flush(lbuf *b);
+void lbuf_free(lbuf *b);
+char *lbuf_reserve(lbuf *b, size_t n);
+void lbuf_putc(lbuf *b, char c);
+void lbuf_puts(lbuf *b, const char *s);
+void lbuf_indent(lbuf *b, int depth);
+void lbuf_num(lbuf *b, long x);
+
+void lval_write(lbuf *b, lval *v, int mode);
+// the mode lval_print and lval_println write in, LWRITE_COMPACT by default
+extern int lval_print_mode;
+void lval_print(lval *v);
+void lval_println(lval *v);
+
+// integer arithmetic wrapping around on overflow
+long lnum_add(long x, long y);
+long lnum_sub(long x, long y);
+long lnum_mul(long x, long y);
+long lnum_neg(long x);
+// y must not be 0
+long lnum_div(long x, long y);
+
+// the operator of (op x ...) with a single character arithmetic operator,
+// 0 for any other lval
+char lval_arith_op(lval *v);
+
+lval *builtin_op(lval *a, char *op);
+// reduce an sexpression whose children have already been evaluated
+lval *lval_eval_sexpr(lval *v);
+
+lval *lval_eval(lval *v);
+
+#endif
@@ -1,9 +1,13 @@
+#include "closure.h"
+#include "compile.h"
+#include "jit.h"
+#include "lval.h"
 #include "mpc.h"
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 
 #ifdef _WIN32
-#include <string.h>
 
 static char buffer[2048];
 
@@ -27,301 +31,286 @@ void add_history(char *history) {}
 #endif
 #endif
 
-typedef struct lval {
-  int type;
-  long num;
-  // error and symbol data
-  char *err;
-  char *sym;
-
-  // cells
-  int cell_count;
-  struct lval **cells;
-} lval;
-
-// possible lval types
-enum { LVAL_ERR, LVAL_NUM, LVAL_SYM, LVAL_SEXPR, LVAL_QEXPR };
-
-// possible error types
-enum { LERR_DIV_ZERO, LERR_BAD_OP, LERR_BAD_NUM };
-
-lval *lval_num(long x) {
-  lval *v = malloc(sizeof(lval));
-  v->type = LVAL_NUM;
-  v->num = x;
-  return v;
-}
-
-lval *lval_err(char *m) {
-  lval *v = malloc(sizeof(lval));
-  v->type = LVAL_ERR;
-  v->err = malloc(strlen(m) + 1);
-  strcpy(v->err, m);
-  return v;
-}
-
-lval *lval_sym(char *s) {
-  lval *v = malloc(sizeof(lval));
-  v->type = LVAL_SYM;
-  v->sym = malloc(strlen(s) + 1);
-  strcpy(v->sym, s);
-  return v;
-}
 
-lval *lval_sexpr(void) {
-  lval *v = malloc(sizeof(lval));
-  v->type = LVAL_SEXPR;
-  v->cell_count = 0;
-  v->cells = NULL;
-  return v;
+// the contents of t point into the input and are not terminated, copy them
+// into buf when they fit and into a new string otherwise
+char *lval_read_text(mpc_ast_t *t, char *buf, size_t size) {
+  size_t n = mpc_ast_contents_len(t);
+  char *s = n < size ? buf : malloc(n + 1);
+  memcpy(s, t->contents, n);
+  s[n] = '\0';
+  return s;
 }
 
-lval *lval_qexpr(void) {
-  lval *v = malloc(sizeof(lval));
-  v->type = LVAL_QEXPR;
-  v->cell_count = 0;
-  v->cells = NULL;
-  return v;
-}
-
-void lval_del(lval *v) {
-  switch (v->type) {
-  case LVAL_NUM:
-    break;
-  case LVAL_ERR:
-    free(v->err);
-    break;
-  case LVAL_SYM:
-    free(v->sym);
-    break;
-  // delete all list elements in case of sexpression / qexpression
-  case LVAL_QEXPR:
-  case LVAL_SEXPR:
-    for (int i = 0; i < v->cell_count; i++) {
-      lval_del(v->cells[i]);
-    }
-    free(v->cells);
-    break;
+lval *lval_read_num(mpc_ast_t *t) {
+  char buf[32];
+  char *s = lval_read_text(t, buf, sizeof(buf));
+  // check for error in conversion
+  errno = 0;
+  long x = strtol(s, NULL, 10);
+  int ok = errno != ERANGE;
+  if (s != buf) {
+    free(s);
   }
+  return ok ? lval_num(x) : lval_err("invalid number");
 }
 
-lval *lval_pop(lval *v, int i) {
-  // find i-th item
-  lval *x = v->cells[i];
 
-  // shift
-  memmove(&v->cells[i], &v->cells[i + 1],
-          sizeof(lval *) * (v->cell_count - i - 1));
-
-  v->cell_count--;
-
-  // reallocate
-  v->cells = realloc(v->cells, sizeof(lval *) * v->cell_count);
-  return x;
-}
-
-lval *lval_take(lval *v, int i) {
-  lval *x = lval_pop(v, i);
-  lval_del(v);
-  return x;
-}
-
-void lval_print(lval *v);
-void lval_expr_print(lval *v, char open, char close) {
-  putchar(open);
-  for (int i = 0; i < v->cell_count; i++) {
-    // print the child value
-    lval_print(v->cells[i]);
-
-    // no trailing space for the last element
-    if (i != (v->cell_count - 1)) {
-      putchar(' ');
+// rule IDs, the positions of the parsers passed to mpca_lang
+enum {
+  LRULE_NUMBER,
+  LRULE_SYMBOL,
+  LRULE_SEXPR,
+  LRULE_QEXPR,
+  LRULE_EXPR,
+  LRULE_LISPY
+};
+
+// create the lval for a single AST node, lists are returned empty
+lval *lval_read_node(mpc_ast_t *t) {
+  switch (t->rule) {
+  case LRULE_NUMBER:
+    return lval_read_num(t);
+  case LRULE_SYMBOL: {
+    char buf[32];
+    char *s = lval_read_text(t, buf, sizeof(buf));
+    lval *x = lval_sym(s);
+    if (s != buf) {
+      free(s);
     }
+    return x;
   }
-  putchar(close);
-}
-
-// print an lval
-void lval_print(lval *v) {
-  switch (v->type) {
-  // print if it's a number
-  case LVAL_NUM:
-    printf("%li", v->num);
-    break;
-
-  case LVAL_ERR:
-    printf("Error: %s", v->err);
-    break;
-
-  case LVAL_SYM:
-    printf("%s", v->sym);
-    break;
-
-  case LVAL_SEXPR:
-    lval_expr_print(v, '(', ')');
-    break;
-
-  case LVAL_QEXPR:
-    lval_expr_print(v, '{', '}');
-    break;
+  case LRULE_SEXPR:
+    return lval_sexpr();
+  case LRULE_QEXPR:
+    return lval_qexpr();
   }
-}
 
-void lval_println(lval *v) {
-  lval_print(v);
-  putchar('\n');
-}
-
-lval *builtin_op(lval *a, char *op) {
-  // check if all arguments are numbers
-  for (int i = 0; i < a->cell_count; i++) {
-    if (a->cells[i]->type != LVAL_NUM) {
-      lval_del(a);
-      return lval_err("Cannot operate on non-numbers!");
-    }
+  // the root holds the top level expressions
+  if (strcmp(t->tag, ">") == 0) {
+    return lval_sexpr();
   }
+  return NULL;
+}
 
-  lval *x = lval_pop(a, 0);
+// check for AST nodes that carry no value, parentheses and the start and
+// end of input are not part of any rule
+int lval_read_skip(mpc_ast_t *t) { return t->rule < 0; }
 
-  // do negation on -
-  if ((strcmp(op, "-") == 0) && a->cell_count == 0) {
-    x->num = -x->num;
+lval *lval_read(mpc_ast_t *t) {
+  lval *x = lval_read_node(t);
+  if (x == NULL || (x->type != LVAL_SEXPR && x->type != LVAL_QEXPR)) {
+    return x;
   }
 
-  // reduce all remaining elements
+  lstack s;
+  lstack_init(&s);
+  lstack_push(&s, x, t);
 
-  while (a->cell_count > 0) {
-    // pop next element
-    lval *y = lval_pop(a, 0);
+  while (1) {
+    lframe *f = lstack_top(&s);
 
-    if (strcmp(op, "+") == 0) {
-      x->num += y->num;
-    }
-    if (strcmp(op, "-") == 0) {
-      x->num -= y->num;
-    }
-    if (strcmp(op, "*") == 0) {
-      x->num *= y->num;
-    }
-    if (strcmp(op, "/") == 0) {
-      if (y->num == 0) {
-        lval_del(x);
-        lval_del(y);
-        x = lval_err("Division by zero!");
+    // list is complete - attach it to its parent
+    if (f->i == f->t->children_num) {
+      x = f->v;
+      s.count--;
+      if (s.count == 0) {
         break;
       }
-      x->num /= y->num;
+      lval_add(lstack_top(&s)->v, x);
+      continue;
     }
 
-    lval_del(y);
+    // fill list of subexpressions
+    mpc_ast_t *child = f->t->children[f->i++];
+    if (lval_read_skip(child)) {
+      continue;
+    }
+    lval *y = lval_read_node(child);
+    if (y == NULL) {
+      continue;
+    }
+    if (y->type == LVAL_SEXPR || y->type == LVAL_QEXPR) {
+      lstack_push(&s, y, child);
+    } else {
+      lval_add(f->v, y);
+    }
   }
 
-  lval_del(a);
+  lstack_free(&s);
   return x;
 }
 
-lval *lval_eval(lval *v);
-
-lval *lval_eval_sexpr(lval *v) {
-  // evaluate children
-  for (int i = 0; i < v->cell_count; i++) {
-    v->cells[i] = lval_eval(v->cells[i]);
+// evaluators selectable with -e
+enum { LENGINE_TREE, LENGINE_CLOSURE };
+int lisp_engine = LENGINE_TREE;
+
+// evaluate v with the selected engine, consumes v
+lval *lisp_eval(lval *v) {
+  if (lisp_engine == LENGINE_CLOSURE) {
+    // expressions nested too deeply for closures fall back to the tree walker
+    lval *r = lclo_eval(v);
+    if (r != NULL) {
+      return r;
+    }
   }
+  return lval_eval(v);
+}
 
-  // error checking
-  for (int i = 0; i < v->cell_count; i++) {
-    if (v->cells[i]->type == LVAL_ERR) {
-      return lval_take(v, i);
+// read a line without its newline, returns NULL at the end of the file
+char *lisp_read_line(FILE *f) {
+  size_t len = 0;
+  size_t cap = 256;
+  char *line = malloc(cap);
+
+  while (fgets(line + len, cap - len, f) != NULL) {
+    len += strlen(line + len);
+    if (len > 0 && line[len - 1] == '\n') {
+      line[len - 1] = '\0';
+      return line;
+    }
+    if (len + 1 < cap) {
+      // last line without a newline
+      return line;
     }
+    cap *= 2;
+    line = realloc(line, cap);
   }
 
-  // empty expression
-  if (v->cell_count == 0) {
-    return v;
+  if (len > 0) {
+    return line;
   }
+  free(line);
+  return NULL;
+}
 
-  // single expression
-  if (v->cell_count == 1) {
-    return lval_take(v, 0);
+// evaluate a script line by line, printing only the results, or translate it
+// to C when a compiler is given
+int lisp_script(mpc_parser_t *Lispy, const char *filename, lcomp *c) {
+  FILE *f = fopen(filename, "r");
+  if (f == NULL) {
+    perror(filename);
+    return 1;
   }
 
-  // more than 1 child - take symbol first
-  lval *first = lval_pop(v, 0);
-  if (first->type != LVAL_SYM) {
-    lval_del(first);
-    lval_del(v);
-    return lval_err("S-expression doesn't start with a symbol!");
+  // one context serves every line
+  mpc_context_t *ctx = mpc_context_new();
+  char *input;
+  while ((input = lisp_read_line(f)) != NULL) {
+    mpc_result_t r;
+    if (mpc_context_parse(ctx, filename, input, Lispy, &r)) {
+      lval *x = lval_read(r.output);
+      if (c != NULL) {
+        lcomp_line(c, x);
+        lval_del(x);
+      } else {
+        lval *e = lisp_eval(x);
+        lval_println(e);
+        lval_del(e);
+      }
+      mpc_ast_delete(r.output);
+    } else {
+      if (c != NULL) {
+        char *msg = mpc_err_string(r.error);
+        lcomp_error(c, msg);
+        free(msg);
+      } else {
+        mpc_err_print(r.error);
+      }
+      mpc_err_delete(r.error);
+    }
+    free(input);
   }
 
-  // call builtin with operator
-  lval *result = builtin_op(v, first->sym);
-  lval_del(first);
-
-  return result;
+  mpc_context_delete(ctx);
+  fclose(f);
+  return 0;
 }
 
-lval *lval_eval(lval *v) {
-  // evaluate sexpressions
-  if (v->type == LVAL_SEXPR) {
-    return lval_eval_sexpr(v);
+// evaluate every top level expression of a stream as soon as it is complete,
+// only the expression being read is kept in memory
+int lisp_stream(mpc_parser_t *Expr, const char *filename) {
+  FILE *f = filename != NULL ? fopen(filename, "r") : stdin;
+  if (f == NULL) {
+    perror(filename);
+    return 1;
   }
-  // return itself for all other types
-  return v;
-}
 
-lval *lval_read_num(mpc_ast_t *t) {
-  // check for error in conversion
-  errno = 0;
-  long x = strtol(t->contents, NULL, 10);
-  return errno != ERANGE ? lval_num(x) : lval_err("invalid number");
-}
-
-lval *lval_add(lval *v, lval *child) {
-  v->cell_count++;
-  v->cells = realloc(v->cells, sizeof(lval *) * v->cell_count);
-  v->cells[v->cell_count - 1] = child;
-  return v;
-}
-
-lval *lval_read(mpc_ast_t *t) {
-  // return numbers directly
-  if (strstr(t->tag, "number")) {
-    return lval_read_num(t);
-  }
+  mpc_stream_t *s =
+      mpc_stream_new(filename != NULL ? filename : "<stdin>", Expr, "(){}",
+                     (mpc_dtor_t)mpc_ast_delete);
+  char chunk[4096];
+  int more = 1;
+  while (more) {
+    // lines are fed as they arrive, long ones in pieces
+    if (fgets(chunk, sizeof(chunk), f) != NULL) {
+      mpc_stream_feed(s, chunk, strlen(chunk));
+    } else {
+      mpc_stream_finish(s);
+      more = 0;
+    }
 
-  if (strstr(t->tag, "symbol")) {
-    return lval_sym(t->contents);
+    mpc_result_t r;
+    while (mpc_stream_next(s, &r)) {
+      lval *e = lisp_eval(lval_read(r.output));
+      lval_println(e);
+      lval_del(e);
+      mpc_ast_delete(r.output);
+    }
+    if (r.error != NULL) {
+      mpc_err_print(r.error);
+      mpc_err_delete(r.error);
+    }
   }
 
-  // if root or sexpr, create empty list
-  lval *x = NULL;
-  if (strcmp(t->tag, ">") == 0) {
-    x = lval_sexpr();
-  }
-  if (strstr(t->tag, "sexpr")) {
-    x = lval_sexpr();
+  mpc_stream_delete(s);
+  if (f != stdin) {
+    fclose(f);
   }
+  return 0;
+}
 
-  if (strstr(t->tag, "qexpr")) {
-    x = lval_qexpr();
+// parse a whole script on several threads, then evaluate each top level
+// expression like a stream
+int lisp_parallel(mpc_parser_t *Lispy, const char *filename, int threads) {
+  FILE *f = fopen(filename, "rb");
+  if (f == NULL) {
+    perror(filename);
+    return 1;
   }
 
-  // fill list of subexpressions
-  for (int i = 0; i < t->children_num; i++) {
-    // skip over parentheses
-    if ((strcmp(t->children[i]->contents, "(") == 0) ||
-        (strcmp(t->children[i]->contents, "(") == 0) ||
-        (strcmp(t->children[i]->contents, "{") == 0) ||
-        (strcmp(t->children[i]->contents, "}") == 0)) {
-      continue;
+  size_t len = 0;
+  size_t cap = 65536;
+  char *data = malloc(cap);
+  size_t n;
+  while ((n = fread(data + len, 1, cap - len, f)) > 0) {
+    len += n;
+    if (len == cap) {
+      cap *= 2;
+      data = realloc(data, cap);
     }
-    if (strcmp(t->children[i]->tag, "regex") == 0) {
-      continue;
+  }
+  fclose(f);
+
+  mpc_result_t r;
+  if (mpca_parse_parallel(filename, data, len, Lispy, "(){}", threads, &r)) {
+    // the root holds the expressions, evaluate them one by one
+    lval *x = lval_read(r.output);
+    for (int i = 0; i < x->cell_count; i++) {
+      lval *e = lisp_eval(x->cells[i]);
+      lval_println(e);
+      lval_del(e);
     }
-    x = lval_add(x, lval_read(t->children[i]));
+    x->cell_count = 0;
+    lval_del(x);
+    mpc_ast_delete(r.output);
+  } else {
+    mpc_err_print(r.error);
+    mpc_err_delete(r.error);
   }
 
-  return x;
+  free(data);
+  return 0;
 }
 
 int main(int argc, char **argv) {
@@ -332,8 +321,9 @@ int main(int argc, char **argv) {
   mpc_parser_t *Qexpr = mpc_new("qexpr");
   mpc_parser_t *Expr = mpc_new("expr");
   mpc_parser_t *Lispy = mpc_new("lispy");
-  // define parsers
-  mpca_lang(MPCA_LANG_DEFAULT, "                                         \
+  // define parsers, their trees point into the input line which outlives them
+  // and are freed in one go
+  mpca_lang(MPCA_LANG_AST_SLICES | MPCA_LANG_AST_ARENA, "         \
           number   : /-?[0-9]+/ ;                     \
           symbol   : '+' | '-' | '*' | '/' ;          \
           sexpr    : '(' <expr>* ')' ;                \
@@ -342,12 +332,94 @@ int main(int argc, char **argv) {
           lispy    : /^/ <expr>* /$/ ;     \
           ",
             Number, Symbol, Sexpr, Qexpr, Expr, Lispy);
+  // only try the alternatives that can start with the next character, then
+  // compile both entry points so deep nesting goes on in the parser VM
+  // instead of running out of recursion, -s parses with Expr
+  mpc_analyse(Lispy);
+  mpc_compile(Lispy);
+  mpc_compile(Expr);
+
+  // options: -e tree|closure picks the evaluator, -c translates to C, -s
+  // reads the script or stdin as one stream of expressions, -j n parses the
+  // whole script on n threads, -p pretty prints the results
+  const char *script = NULL;
+  int translate = 0;
+  int stream = 0;
+  int threads = 0;
+  for (int i = 1; i < argc; i++) {
+    if (strcmp(argv[i], "-c") == 0) {
+      translate = 1;
+    } else if (strcmp(argv[i], "-s") == 0) {
+      stream = 1;
+    } else if (strcmp(argv[i], "-p") == 0) {
+      lval_print_mode = LWRITE_PRETTY;
+    } else if (strcmp(argv[i], "-j") == 0 && i + 1 < argc) {
+      threads = atoi(argv[++i]);
+    } else if (strcmp(argv[i], "-e") == 0 && i + 1 < argc) {
+      i++;
+      if (strcmp(argv[i], "tree") == 0) {
+        lisp_engine = LENGINE_TREE;
+      } else if (strcmp(argv[i], "closure") == 0) {
+        lisp_engine = LENGINE_CLOSURE;
+      } else {
+        fprintf(stderr, "unknown engine %s, use tree or closure\n", argv[i]);
+        return 1;
+      }
+    } else {
+      script = argv[i];
+    }
+  }
+
+  // -c script: write the script translated to C to stdout
+  if (translate) {
+    if (script == NULL) {
+      fprintf(stderr, "usage: %s -c script\n", argv[0]);
+      return 1;
+    }
+    lbuf b;
+    lcomp c;
+    lbuf_init(&b, stdout);
+    lcomp_init(&c, &b);
+    int status = lisp_script(Lispy, script, &c);
+    lcomp_finish(&c);
+    lbuf_free(&b);
+    mpc_cleanup(6, Number, Symbol, Sexpr, Qexpr, Expr, Lispy);
+    return status;
+  }
+
+  // -s [script]: evaluate each expression as soon as it has been read
+  if (stream) {
+    int status = lisp_stream(Expr, script);
+    mpc_cleanup(6, Number, Symbol, Sexpr, Qexpr, Expr, Lispy);
+    ljit_cleanup();
+    lclo_cleanup();
+    return status;
+  }
+
+  // -j n script: evaluate each expression once all of them have been read
+  if (threads > 0 && script != NULL) {
+    int status = lisp_parallel(Lispy, script, threads);
+    mpc_cleanup(6, Number, Symbol, Sexpr, Qexpr, Expr, Lispy);
+    ljit_cleanup();
+    lclo_cleanup();
+    return status;
+  }
+
+  // script: run it instead of the REPL
+  if (script != NULL) {
+    int status = lisp_script(Lispy, script, NULL);
+    mpc_cleanup(6, Number, Symbol, Sexpr, Qexpr, Expr, Lispy);
+    ljit_cleanup();
+    lclo_cleanup();
+    return status;
+  }
 
   // print version information
   puts("mylisp 0.1");
   puts("Press Ctrl+C to exit");
 
   // REPL
+  mpc_context_t *ctx = mpc_context_new();
   while (1) {
     char *input = readline(" > ");
     add_history(input);
@@ -356,7 +428,7 @@ int main(int argc, char **argv) {
     // printf("%s \n", input);
 
     mpc_result_t r;
-    if (mpc_parse("<stdin>", input, Lispy, &r)) {
+    if (mpc_context_parse(ctx, "<stdin>", input, Lispy, &r)) {
       // print AST on success
       mpc_ast_print(r.output);
 
@@ -364,9 +436,9 @@ int main(int argc, char **argv) {
       // lval result = eval(r.output);
       lval *x = lval_read(r.output);
       lval_println(x);
-      lval *e = lval_eval(x);
+      lval *e = lisp_eval(x);
       lval_println(e);
-      lval_del(x);
+      lval_del(e);
       mpc_ast_delete(r.output);
     } else {
       mpc_err_print(r.error);
@@ -377,5 +449,8 @@ int main(int argc, char **argv) {
     free(input);
   }
   // clean up parsers
-  mpc_cleanup(5, Number, Symbol, Sexpr, Qexpr, Expr, Lispy);
+  mpc_context_delete(ctx);
+  mpc_cleanup(6, Number, Symbol, Sexpr, Qexpr, Expr, Lispy);
+  ljit_cleanup();
+  lclo_cleanup();
 }
@@ -1,5 +1,21 @@
 #include "mpc.h"
 
+/* strict ISO builds have no fileno */
+#if (defined(__unix__) || defined(__APPLE__)) && !defined(__STRICT_ANSI__)
+#define MPC_MMAP
+#include <sys/mman.h>
+#include <sys/stat.h>
+#endif
+
+#ifdef MPC_THREADS
+#include <pthread.h>
+#include <unistd.h>
+#endif
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
 /*
 ** State Type
 */
@@ -39,6 +55,8 @@ static mpc_state_t mpc_state_new(void) {
 ** easy. The contents are never loaded into
 ** memory but backtracking can still be achieved
 ** by seeking in the file at different positions.
+** Where the system allows it regular files are
+** mapped into memory and parsed as a String.
 **
 ** The final mode is Pipe. This is the difficult
 ** one. As we assume pipes cannot be seeked - and
@@ -49,7 +67,9 @@ static mpc_state_t mpc_state_new(void) {
 **
 ** This means that if we are requested to seek
 ** back we can simply start reading from the
-** buffer instead of the input.
+** buffer instead of the input. The buffer is a
+** list of fixed size chunks, chunks the input
+** has passed are released once no marks are left.
 **
 ** Of course using `mpc_predictive` will disable
 ** backtracking and make LL(1) grammars easy
@@ -64,16 +84,92 @@ enum {
 };
 
 enum {
-  MPC_INPUT_MARKS_MIN = 32
+  MPC_INPUT_MARKS_MIN = 32,
+  MPC_INPUT_CHUNK_SIZE = 4096
+};
+
+/*
+** Scratch memory of a parse is bumped out of
+** the newest block of an arena. Each allocation
+** is preceded by its size so that `mpc_export`
+** can copy it out when it escapes the parse.
+** Only the latest allocation can be given back
+** early, everything else is released together
+** when the arena is reset. Reset keeps the
+** newest block, so parsing more input of about
+** the same size does not allocate again.
+*/
+
+enum {
+  MPC_ARENA_BLOCK_MIN = 32768,
+  MPC_ARENA_KEEP_MAX  = 16777216
+};
+
+typedef union {
+  size_t size;
+  long l;
+  double d;
+  void *p;
+} mpc_arena_hdr_t;
+
+typedef struct mpc_block_t {
+  struct mpc_block_t *next;
+  char *data;
+  size_t size;
+  size_t used;
+} mpc_block_t;
+
+typedef struct mpc_ast_store_t {
+  mpc_block_t *blocks;
+  char **tags;
+  unsigned long tags_num;
+  unsigned long tags_slots;
+  int slices;
+  int nodes;
+  int dirty;
+  struct mpc_ast_t *root;
+  struct mpc_ast_store_t *next;
+} mpc_ast_store_t;
+
+/*
+** Packrat memo table for parsers with `memo`
+** set. Entries are direct mapped on (parser,
+** position, flags) so the table never grows,
+** a colliding entry simply replaces the old one.
+**
+** A success is only remembered as SEEN at
+** first, its output goes into the table once
+** the same parse is requested again. The table
+** and the trees it is replayed into share that
+** output through `refs`, so replays take the
+** same time however large it is. Grammars that
+** never backtrack over a rule never share its
+** nodes, which would make folding them copy
+** nodes.
+*/
+
+enum {
+  MPC_INPUT_MEMO_NUM = 4096
 };
 
 enum {
-  MPC_INPUT_MEM_NUM = 512
+  MPC_MEMO_EMPTY   = 0,
+  MPC_MEMO_SEEN    = 1,
+  MPC_MEMO_SUCCESS = 2,
+  MPC_MEMO_FAILURE = 3
 };
 
 typedef struct {
-  char mem[64];
-} mpc_mem_t;
+  mpc_parser_t *parser;
+  long pos;
+  int flags;
+  int kind;
+  mpc_state_t state;
+  char last;
+  mpc_val_t *output;
+  mpc_err_t *error;
+  mpc_err_t *merged;
+} mpc_memo_t;
 
 typedef struct {
 
@@ -81,8 +177,13 @@ typedef struct {
   char *filename;
   mpc_state_t state;
 
-  char *string;
-  char *buffer;
+  const char *string;
+  long length;
+  char **buffer;
+  int buffer_num;
+  int buffer_slots;
+  long buffer_pos;
+  long buffer_end;
   FILE *file;
 
   int suppress;
@@ -94,40 +195,24 @@ typedef struct {
   char *lasts;
   char last;
 
-  size_t mem_index;
-  char mem_full[MPC_INPUT_MEM_NUM];
-  mpc_mem_t mem[MPC_INPUT_MEM_NUM];
-
-} mpc_input_t;
-
-static mpc_input_t *mpc_input_new_string(const char *filename, const char *string) {
-
-  mpc_input_t *i = malloc(sizeof(mpc_input_t));
+  mpc_block_t *arena;
 
-  i->filename = malloc(strlen(filename) + 1);
-  strcpy(i->filename, filename);
-  i->type = MPC_INPUT_STRING;
+  mpc_memo_t *memo;
 
-  i->state = mpc_state_new();
+  int lazy;
 
-  i->string = malloc(strlen(string) + 1);
-  strcpy(i->string, string);
-  i->buffer = NULL;
-  i->file = NULL;
+  mpc_ast_store_t *ast;
+  int slices;
 
-  i->suppress = 0;
-  i->backtrack = 1;
-  i->marks_num = 0;
-  i->marks_slots = MPC_INPUT_MARKS_MIN;
-  i->marks = malloc(sizeof(mpc_state_t) * i->marks_slots);
-  i->lasts = malloc(sizeof(char) * i->marks_slots);
-  i->last = '\0';
+  mpc_state_t origin;
+  char origin_last;
+  int partial;
+  int starved;
+  int stats;
 
-  i->mem_index = 0;
-  memset(i->mem_full, 0, sizeof(char) * MPC_INPUT_MEM_NUM);
+  struct mpc_prog_t *prog;
 
-  return i;
-}
+} mpc_input_t;
 
 static mpc_input_t *mpc_input_new_nstring(const char *filename, const char *string, size_t length) {
 
@@ -139,10 +224,13 @@ static mpc_input_t *mpc_input_new_nstring(const char *filename, const char *stri
 
   i->state = mpc_state_new();
 
-  i->string = malloc(length + 1);
-  strncpy(i->string, string, length);
-  i->string[length] = '\0';
+  i->string = string;
+  i->length = length;
   i->buffer = NULL;
+  i->buffer_num = 0;
+  i->buffer_slots = 0;
+  i->buffer_pos = 0;
+  i->buffer_end = 0;
   i->file = NULL;
 
   i->suppress = 0;
@@ -153,13 +241,30 @@ static mpc_input_t *mpc_input_new_nstring(const char *filename, const char *stri
   i->lasts = malloc(sizeof(char) * i->marks_slots);
   i->last = '\0';
 
-  i->mem_index = 0;
-  memset(i->mem_full, 0, sizeof(char) * MPC_INPUT_MEM_NUM);
+  i->arena = NULL;
+
+  i->memo = NULL;
+
+  i->lazy = i->type == MPC_INPUT_STRING;
+
+  i->ast = NULL;
+  i->slices = i->type == MPC_INPUT_STRING;
+
+  i->origin = i->state;
+  i->origin_last = '\0';
+  i->partial = 0;
+  i->starved = 0;
+  i->stats = 1;
+  i->prog = NULL;
 
   return i;
 
 }
 
+static mpc_input_t *mpc_input_new_string(const char *filename, const char *string) {
+  return mpc_input_new_nstring(filename, string, strlen(string));
+}
+
 static mpc_input_t *mpc_input_new_pipe(const char *filename, FILE *pipe) {
 
   mpc_input_t *i = malloc(sizeof(mpc_input_t));
@@ -171,7 +276,12 @@ static mpc_input_t *mpc_input_new_pipe(const char *filename, FILE *pipe) {
   i->state = mpc_state_new();
 
   i->string = NULL;
+  i->length = 0;
   i->buffer = NULL;
+  i->buffer_num = 0;
+  i->buffer_slots = 0;
+  i->buffer_pos = 0;
+  i->buffer_end = 0;
   i->file = pipe;
 
   i->suppress = 0;
@@ -182,8 +292,21 @@ static mpc_input_t *mpc_input_new_pipe(const char *filename, FILE *pipe) {
   i->lasts = malloc(sizeof(char) * i->marks_slots);
   i->last = '\0';
 
-  i->mem_index = 0;
-  memset(i->mem_full, 0, sizeof(char) * MPC_INPUT_MEM_NUM);
+  i->arena = NULL;
+
+  i->memo = NULL;
+
+  i->lazy = i->type == MPC_INPUT_STRING;
+
+  i->ast = NULL;
+  i->slices = i->type == MPC_INPUT_STRING;
+
+  i->origin = i->state;
+  i->origin_last = '\0';
+  i->partial = 0;
+  i->starved = 0;
+  i->stats = 1;
+  i->prog = NULL;
 
   return i;
 
@@ -199,7 +322,12 @@ static mpc_input_t *mpc_input_new_file(const char *filename, FILE *file) {
   i->state = mpc_state_new();
 
   i->string = NULL;
+  i->length = 0;
   i->buffer = NULL;
+  i->buffer_num = 0;
+  i->buffer_slots = 0;
+  i->buffer_pos = 0;
+  i->buffer_end = 0;
   i->file = file;
 
   i->suppress = 0;
@@ -210,48 +338,126 @@ static mpc_input_t *mpc_input_new_file(const char *filename, FILE *file) {
   i->lasts = malloc(sizeof(char) * i->marks_slots);
   i->last = '\0';
 
-  i->mem_index = 0;
-  memset(i->mem_full, 0, sizeof(char) * MPC_INPUT_MEM_NUM);
+  i->arena = NULL;
+
+  i->memo = NULL;
+
+  i->lazy = i->type == MPC_INPUT_STRING;
+
+  i->ast = NULL;
+  i->slices = i->type == MPC_INPUT_STRING;
+
+  i->origin = i->state;
+  i->origin_last = '\0';
+  i->partial = 0;
+  i->starved = 0;
+  i->stats = 1;
+  i->prog = NULL;
 
   return i;
 }
 
+static void mpc_memo_clear(mpc_memo_t *m) {
+  if (m->output) { mpc_ast_delete(m->output); }
+  if (m->error) { mpc_err_delete(m->error); }
+  if (m->merged) { mpc_err_delete(m->merged); }
+  memset(m, 0, sizeof(mpc_memo_t));
+}
+
+static void mpc_memo_reset(mpc_input_t *i) {
+  int j;
+  if (i->memo == NULL) { return; }
+  for (j = 0; j < MPC_INPUT_MEMO_NUM; j++) { mpc_memo_clear(&i->memo[j]); }
+}
+
+static void mpc_arena_free(mpc_block_t *b) {
+  mpc_block_t *next;
+  while (b != NULL) {
+    next = b->next;
+    free(b->data);
+    free(b);
+    b = next;
+  }
+}
+
+static void mpc_arena_reset(mpc_input_t *i) {
+  mpc_block_t *b = i->arena;
+  if (b == NULL) { return; }
+  if (b->size > MPC_ARENA_KEEP_MAX) {
+    mpc_arena_free(b);
+    i->arena = NULL;
+    return;
+  }
+  /* older blocks are smaller, only the newest one is worth keeping */
+  mpc_arena_free(b->next);
+  b->next = NULL;
+  b->used = 0;
+}
+
 static void mpc_input_delete(mpc_input_t *i) {
 
+  int j;
+
   free(i->filename);
 
-  if (i->type == MPC_INPUT_STRING) { free(i->string); }
-  if (i->type == MPC_INPUT_PIPE) { free(i->buffer); }
+  mpc_memo_reset(i);
+  free(i->memo);
+
+  for (j = 0; j < i->buffer_num; j++) { free(i->buffer[j]); }
+  free(i->buffer);
 
+  mpc_arena_free(i->arena);
   free(i->marks);
   free(i->lasts);
   free(i);
 }
 
-static int mpc_mem_ptr(mpc_input_t *i, void *p) {
-  return
-    (char*)p >= (char*)(i->mem) &&
-    (char*)p <  (char*)(i->mem) + (MPC_INPUT_MEM_NUM * sizeof(mpc_mem_t));
+static mpc_block_t *mpc_arena_find(mpc_input_t *i, void *p) {
+  mpc_block_t *b;
+  for (b = i->arena; b != NULL; b = b->next) {
+    if ((char*)p >= b->data && (char*)p < b->data + b->used) { return b; }
+  }
+  return NULL;
 }
 
-static void *mpc_malloc(mpc_input_t *i, size_t n) {
-  size_t j;
-  char *p;
+static size_t mpc_arena_size(void *p) {
+  return ((mpc_arena_hdr_t*)p - 1)->size;
+}
 
-  if (n > sizeof(mpc_mem_t)) { return malloc(n); }
+/* sizes are kept in whole headers so every allocation stays aligned */
+static size_t mpc_arena_round(size_t n) {
+  size_t u = sizeof(mpc_arena_hdr_t);
+  return n == 0 ? u : (n + u - 1) / u * u;
+}
 
-  j = i->mem_index;
-  do {
-    if (!i->mem_full[i->mem_index]) {
-      p = (void*)(i->mem + i->mem_index);
-      i->mem_full[i->mem_index] = 1;
-      i->mem_index = (i->mem_index+1) % MPC_INPUT_MEM_NUM;
-      return p;
-    }
-    i->mem_index = (i->mem_index+1) % MPC_INPUT_MEM_NUM;
-  } while (j != i->mem_index);
+static int mpc_arena_last(mpc_block_t *b, void *p) {
+  return (char*)p + mpc_arena_size(p) == b->data + b->used;
+}
 
-  return malloc(n);
+static mpc_block_t *mpc_arena_grow(mpc_input_t *i, size_t n) {
+  mpc_block_t *b = malloc(sizeof(mpc_block_t));
+  b->size = i->arena ? i->arena->size * 2 : MPC_ARENA_BLOCK_MIN;
+  while (b->size < n) { b->size *= 2; }
+  b->data = malloc(b->size);
+  b->used = 0;
+  b->next = i->arena;
+  i->arena = b;
+  return b;
+}
+
+static void *mpc_malloc(mpc_input_t *i, size_t n) {
+  mpc_block_t *b = i->arena;
+  mpc_arena_hdr_t *h;
+  size_t m = mpc_arena_round(n);
+
+  if (b == NULL || b->size - b->used < m + sizeof(mpc_arena_hdr_t)) {
+    b = mpc_arena_grow(i, m + sizeof(mpc_arena_hdr_t));
+  }
+
+  h = (mpc_arena_hdr_t*)(b->data + b->used);
+  h->size = m;
+  b->used += m + sizeof(mpc_arena_hdr_t);
+  return h + 1;
 }
 
 static void *mpc_calloc(mpc_input_t *i, size_t n, size_t m) {
@@ -261,37 +467,272 @@ static void *mpc_calloc(mpc_input_t *i, size_t n, size_t m) {
 }
 
 static void mpc_free(mpc_input_t *i, void *p) {
-  size_t j;
-  if (!mpc_mem_ptr(i, p)) { free(p); return; }
-  j = ((size_t)(((char*)p) - ((char*)i->mem))) / sizeof(mpc_mem_t);
-  i->mem_full[j] = 0;
+  mpc_block_t *b = mpc_arena_find(i, p);
+  if (b == NULL) { free(p); return; }
+  if (mpc_arena_last(b, p)) {
+    b->used -= mpc_arena_size(p) + sizeof(mpc_arena_hdr_t);
+  }
 }
 
 static void *mpc_realloc(mpc_input_t *i, void *p, size_t n) {
 
-  char *q = NULL;
+  mpc_block_t *b = mpc_arena_find(i, p);
+  size_t m, k;
+  char *q;
+
+  if (b == NULL) { return realloc(p, n); }
 
-  if (!mpc_mem_ptr(i, p)) { return realloc(p, n); }
+  m = mpc_arena_size(p);
+  k = mpc_arena_round(n);
+  if (k <= m) { return p; }
 
-  if (n > sizeof(mpc_mem_t)) {
-    q = malloc(n);
-    memcpy(q, p, sizeof(mpc_mem_t));
-    mpc_free(i, p);
-    return q;
+  /* the latest allocation can grow in place */
+  if (b == i->arena && mpc_arena_last(b, p) && b->size - b->used >= k - m) {
+    ((mpc_arena_hdr_t*)p - 1)->size = k;
+    b->used += k - m;
+    return p;
   }
 
-  return p;
+  q = mpc_malloc(i, n);
+  memcpy(q, p, m);
+  mpc_free(i, p);
+  return q;
 }
 
 static void *mpc_export(mpc_input_t *i, void *p) {
   char *q = NULL;
-  if (!mpc_mem_ptr(i, p)) { return p; }
-  q = malloc(sizeof(mpc_mem_t));
-  memcpy(q, p, sizeof(mpc_mem_t));
+  if (mpc_arena_find(i, p) == NULL) { return p; }
+  q = malloc(mpc_arena_size(p));
+  memcpy(q, p, mpc_arena_size(p));
   mpc_free(i, p);
   return q;
 }
 
+/*
+** AST Store
+**
+** Trees parsed with MPCA_LANG_AST_SLICES keep
+** one copy of every distinct tag in a store,
+** and their contents point into the string that
+** was parsed. Inputs that don't outlive the parse
+** copy contents into the store instead. The store
+** is handed to the root of the finished tree and
+** released along with it.
+**
+** With MPCA_LANG_AST_ARENA the nodes and their
+** children arrays are allocated from the store
+** as well, so deleting the root releases the
+** whole tree at once. Only when the tree has
+** been changed since the parse, which marks the
+** store `dirty`, are the nodes walked first.
+*/
+
+enum {
+  MPC_STORE_BLOCK_MIN = 4096,
+  MPC_STORE_TAGS_MIN  = 64
+};
+
+static mpc_ast_store_t *mpc_store_new(int slices, int nodes) {
+  mpc_ast_store_t *s = malloc(sizeof(mpc_ast_store_t));
+  s->blocks = NULL;
+  s->slices = slices;
+  s->nodes = nodes;
+  s->dirty = 0;
+  s->root = NULL;
+  s->next = NULL;
+  s->tags_num = 0;
+  s->tags_slots = MPC_STORE_TAGS_MIN;
+  s->tags = calloc(s->tags_slots, sizeof(char*));
+  return s;
+}
+
+/* a tree stitched from several parses owns all of their stores */
+static void mpc_store_delete(mpc_ast_store_t *s) {
+  mpc_ast_store_t *next;
+  while (s != NULL) {
+    next = s->next;
+    mpc_arena_free(s->blocks);
+    free(s->tags);
+    free(s);
+    s = next;
+  }
+}
+
+static char *mpc_store_alloc(mpc_ast_store_t *s, size_t n) {
+  mpc_block_t *b = s->blocks;
+  if (b == NULL || b->size - b->used < n) {
+    b = malloc(sizeof(mpc_block_t));
+    b->size = s->blocks ? s->blocks->size * 2 : MPC_STORE_BLOCK_MIN;
+    while (b->size < n) { b->size *= 2; }
+    b->data = malloc(b->size);
+    b->used = 0;
+    b->next = s->blocks;
+    s->blocks = b;
+  }
+  b->used += n;
+  return b->data + b->used - n;
+}
+
+static void *mpc_store_alloc_aligned(mpc_ast_store_t *s, size_t n) {
+  size_t u = sizeof(mpc_arena_hdr_t);
+  if (s->blocks) { s->blocks->used = (s->blocks->used + u - 1) / u * u; }
+  return mpc_store_alloc(s, n);
+}
+
+static unsigned long mpc_store_hash(const char *t, size_t n) {
+  unsigned long h = 2166136261ul;
+  size_t j;
+  for (j = 0; j < n; j++) { h = ((h ^ (unsigned char)t[j]) * 16777619ul) & 0xFFFFFFFFul; }
+  return h;
+}
+
+static void mpc_store_rehash(mpc_ast_store_t *s) {
+  char **tags = s->tags;
+  unsigned long slots = s->tags_slots;
+  unsigned long j, k;
+  s->tags_slots = slots * 2;
+  s->tags = calloc(s->tags_slots, sizeof(char*));
+  for (j = 0; j < slots; j++) {
+    if (tags[j] == NULL) { continue; }
+    k = mpc_store_hash(tags[j], strlen(tags[j])) & (s->tags_slots - 1);
+    while (s->tags[k] != NULL) { k = (k + 1) & (s->tags_slots - 1); }
+    s->tags[k] = tags[j];
+  }
+  free(tags);
+}
+
+static char *mpc_store_intern(mpc_ast_store_t *s, const char *t, size_t n) {
+  unsigned long k;
+  char *x;
+  if (2 * (s->tags_num + 1) > s->tags_slots) { mpc_store_rehash(s); }
+  k = mpc_store_hash(t, n) & (s->tags_slots - 1);
+  while ((x = s->tags[k]) != NULL) {
+    if (strncmp(x, t, n) == 0 && x[n] == '\0') { return x; }
+    k = (k + 1) & (s->tags_slots - 1);
+  }
+  x = mpc_store_alloc(s, n + 1);
+  memcpy(x, t, n);
+  x[n] = '\0';
+  s->tags[k] = x;
+  s->tags_num++;
+  return x;
+}
+
+/*
+** Tokens are built once the whitespace after
+** them has been consumed, so their text is looked
+** for just before the current position, stepping
+** back over that whitespace.
+*/
+
+static const char *mpc_input_slice_find(mpc_input_t *i, const char *c, long n) {
+  long end = i->state.pos;
+  if (!i->ast->slices) { return NULL; }
+  while (end >= n) {
+    if (memcmp(i->string + end - n, c, n) == 0) { return i->string + end - n; }
+    if (i->string[end-1] == '\0' || !strchr(" \f\n\r\t\v", i->string[end-1])) { break; }
+    end--;
+  }
+  return NULL;
+}
+
+static mpc_ast_t *mpc_input_ast_alloc(mpc_input_t *i) {
+  mpc_ast_t *a;
+  if (i->ast->nodes) {
+    a = mpc_store_alloc_aligned(i->ast, sizeof(mpc_ast_t));
+    a->flags = MPC_AST_SHARED_TAG | MPC_AST_SHARED_CONTENTS
+             | MPC_AST_SHARED_NODE | MPC_AST_SHARED_CHILDREN;
+    a->store = i->ast;
+  } else {
+    a = malloc(sizeof(mpc_ast_t));
+    a->flags = MPC_AST_SHARED_TAG | MPC_AST_SHARED_CONTENTS;
+    a->store = NULL;
+  }
+  a->refs = 0;
+  return a;
+}
+
+static void mpc_input_ast_children(mpc_input_t *i, mpc_ast_t *r, int n) {
+  r->children_num = 0;
+  r->children = (r->flags & MPC_AST_SHARED_CHILDREN)
+    ? mpc_store_alloc_aligned(i->ast, sizeof(mpc_ast_t*) * n)
+    : malloc(sizeof(mpc_ast_t*) * n);
+}
+
+static mpc_ast_t *mpc_input_ast_new(mpc_input_t *i, const char *tag, const char *contents) {
+
+  mpc_ast_t *a = mpc_input_ast_alloc(i);
+  long n = strlen(contents);
+  const char *c = n == 0 ? "" : mpc_input_slice_find(i, contents, n);
+
+  if (c == NULL) {
+    c = mpc_store_alloc(i->ast, n + 1);
+    memcpy((char*)c, contents, n + 1);
+  }
+
+  a->tag = mpc_store_intern(i->ast, tag, strlen(tag));
+  a->contents = (char*)c;
+  a->length = n;
+  a->rule = -1;
+  a->rules = 0;
+
+  a->state = mpc_state_new();
+
+  a->children_num = 0;
+  a->children = NULL;
+  return a;
+}
+
+static mpc_ast_t *mpc_ast_unshare(mpc_ast_t *a);
+
+static mpc_ast_t *mpc_input_ast_retag(mpc_input_t *i, mpc_ast_t *a, const char *t, size_t n) {
+  a = mpc_ast_unshare(a);
+  if (!(a->flags & MPC_AST_SHARED_TAG)) { free(a->tag); }
+  a->tag = mpc_store_intern(i->ast, t, n);
+  a->flags |= MPC_AST_SHARED_TAG;
+  return a;
+}
+
+static mpc_ast_t *mpc_input_ast_tag(mpc_input_t *i, mpc_ast_t *a, const char *t) {
+  return mpc_input_ast_retag(i, a, t, strlen(t));
+}
+
+static mpc_ast_t *mpc_input_ast_add_tag(mpc_input_t *i, mpc_ast_t *a, const char *t, size_t n, int sep) {
+  size_t m;
+  char *b;
+  if (a == NULL) { return a; }
+  m = strlen(a->tag);
+  b = mpc_malloc(i, n + sep + m);
+  memcpy(b, t, n);
+  if (sep) { b[n] = '|'; }
+  memcpy(b + n + sep, a->tag, m);
+  a = mpc_input_ast_retag(i, a, b, n + sep + m);
+  mpc_free(i, b);
+  return a;
+}
+
+static void mpc_ast_rule_set(mpc_ast_t *a, int id) {
+  if (id < 0) { return; }
+  if (a->rule < 0) { a->rule = id; }
+  if (id < (int)sizeof(unsigned long) * 8) { a->rules |= 1UL << id; }
+}
+
+/* a child lifted out of `a` takes on its rules too */
+static void mpc_ast_rule_lift(mpc_ast_t *c, mpc_ast_t *a) {
+  if (c->rule < 0) { c->rule = a->rule; }
+  c->rules |= a->rules;
+}
+
+static mpc_ast_t *mpc_input_ast_add_root(mpc_input_t *i, mpc_ast_t *a) {
+  mpc_ast_t *r;
+  if (a == NULL) { return a; }
+  if (a->children_num <= 1) { return a; }
+  r = mpc_input_ast_new(i, ">", "");
+  mpc_input_ast_children(i, r, 1);
+  r->children[r->children_num++] = a;
+  return r;
+}
+
 static void mpc_input_backtrack_disable(mpc_input_t *i) { i->backtrack--; }
 static void mpc_input_backtrack_enable(mpc_input_t *i) { i->backtrack++; }
 
@@ -313,14 +754,18 @@ static void mpc_input_mark(mpc_input_t *i) {
   i->marks[i->marks_num-1] = i->state;
   i->lasts[i->marks_num-1] = i->last;
 
-  if (i->type == MPC_INPUT_PIPE && i->marks_num == 1) {
-    i->buffer = calloc(1, 1);
+  /* everything buffered has been read, start again at the input */
+  if (i->type == MPC_INPUT_PIPE && i->marks_num == 1
+  &&  i->state.pos >= i->buffer_end) {
+    i->buffer_pos = i->state.pos;
+    i->buffer_end = i->state.pos;
   }
 
 }
 
+static void mpc_input_buffer_release(mpc_input_t *i);
+
 static void mpc_input_unmark(mpc_input_t *i) {
-  int j;
 
   if (i->backtrack < 1) { return; }
 
@@ -336,11 +781,7 @@ static void mpc_input_unmark(mpc_input_t *i) {
   }
 
   if (i->type == MPC_INPUT_PIPE && i->marks_num == 0) {
-    for (j = strlen(i->buffer) - 1; j >= 0; j--)
-      ungetc(i->buffer[j], i->file);
-
-    free(i->buffer);
-    i->buffer = NULL;
+    mpc_input_buffer_release(i);
   }
 
 }
@@ -359,12 +800,44 @@ static void mpc_input_rewind(mpc_input_t *i) {
   mpc_input_unmark(i);
 }
 
+/*
+** The first chunk of the pipe buffer starts at
+** `buffer_pos`, everything up to `buffer_end` is
+** read from the chunks instead of the pipe.
+*/
+
 static int mpc_input_buffer_in_range(mpc_input_t *i) {
-  return i->state.pos < (long)(strlen(i->buffer) + i->marks[0].pos);
+  return i->state.pos < i->buffer_end;
 }
 
 static char mpc_input_buffer_get(mpc_input_t *i) {
-  return i->buffer[i->state.pos - i->marks[0].pos];
+  long k = i->state.pos - i->buffer_pos;
+  return i->buffer[k / MPC_INPUT_CHUNK_SIZE][k % MPC_INPUT_CHUNK_SIZE];
+}
+
+static void mpc_input_buffer_put(mpc_input_t *i, char c) {
+  long k = i->buffer_end - i->buffer_pos;
+  if (k == (long)i->buffer_num * MPC_INPUT_CHUNK_SIZE) {
+    if (i->buffer_num == i->buffer_slots) {
+      i->buffer_slots = i->buffer_slots ? i->buffer_slots * 2 : 4;
+      i->buffer = realloc(i->buffer, sizeof(char*) * i->buffer_slots);
+    }
+    i->buffer[i->buffer_num++] = malloc(MPC_INPUT_CHUNK_SIZE);
+  }
+  i->buffer[k / MPC_INPUT_CHUNK_SIZE][k % MPC_INPUT_CHUNK_SIZE] = c;
+  i->buffer_end++;
+}
+
+static void mpc_input_buffer_release(mpc_input_t *i) {
+  int j;
+  long k = (i->state.pos - i->buffer_pos) / MPC_INPUT_CHUNK_SIZE;
+  /* the chunk being read, or the last one to be refilled, stays */
+  if (k >= i->buffer_num) { k = i->buffer_num - 1; }
+  if (k <= 0) { return; }
+  for (j = 0; j < k; j++) { free(i->buffer[j]); }
+  memmove(i->buffer, i->buffer + k, sizeof(char*) * (i->buffer_num - k));
+  i->buffer_num -= (int)k;
+  i->buffer_pos += k * MPC_INPUT_CHUNK_SIZE;
 }
 
 static char mpc_input_getc(mpc_input_t *i) {
@@ -377,9 +850,7 @@ static char mpc_input_getc(mpc_input_t *i) {
     case MPC_INPUT_FILE: c = fgetc(i->file); return c;
     case MPC_INPUT_PIPE:
 
-      if (!i->buffer) { c = getc(i->file); return c; }
-
-      if (i->buffer && mpc_input_buffer_in_range(i)) {
+      if (mpc_input_buffer_in_range(i)) {
         c = mpc_input_buffer_get(i);
         return c;
       } else {
@@ -396,7 +867,8 @@ static char mpc_input_peekc(mpc_input_t *i) {
   char c = '\0';
 
   switch (i->type) {
-    case MPC_INPUT_STRING: return i->string[i->state.pos];
+    case MPC_INPUT_STRING:
+      return i->state.pos < i->length ? i->string[i->state.pos] : '\0';
     case MPC_INPUT_FILE:
 
       c = fgetc(i->file);
@@ -407,14 +879,7 @@ static char mpc_input_peekc(mpc_input_t *i) {
 
     case MPC_INPUT_PIPE:
 
-      if (!i->buffer) {
-        c = getc(i->file);
-        if (feof(i->file)) { return '\0'; }
-        ungetc(c, i->file);
-        return c;
-      }
-
-      if (i->buffer && mpc_input_buffer_in_range(i)) {
+      if (mpc_input_buffer_in_range(i)) {
         return mpc_input_buffer_get(i);
       } else {
         c = getc(i->file);
@@ -428,7 +893,23 @@ static char mpc_input_peekc(mpc_input_t *i) {
 
 }
 
+/*
+** A stream parses what has been fed to it so
+** far, which may stop in the middle of an item.
+** Every test for the end of a string notes it
+** in `starved`, a result that depended on it may
+** change once more input arrives.
+*/
+
+static int mpc_input_end(mpc_input_t *i) {
+  if (i->state.pos < i->length) { return 0; }
+  i->starved = 1;
+  return 1;
+}
+
+/* strings end at their length, so they may contain '\0' */
 static int mpc_input_terminated(mpc_input_t *i) {
+  if (i->type == MPC_INPUT_STRING) { return mpc_input_end(i); }
   return mpc_input_peekc(i) == '\0';
 }
 
@@ -439,9 +920,7 @@ static int mpc_input_failure(mpc_input_t *i, char c) {
     case MPC_INPUT_FILE: fseek(i->file, -1, SEEK_CUR); { break; }
     case MPC_INPUT_PIPE: {
 
-      if (!i->buffer) { ungetc(c, i->file); break; }
-
-      if (i->buffer && mpc_input_buffer_in_range(i)) {
+      if (mpc_input_buffer_in_range(i)) {
         break;
       } else {
         ungetc(c, i->file);
@@ -454,11 +933,9 @@ static int mpc_input_failure(mpc_input_t *i, char c) {
 
 static int mpc_input_success(mpc_input_t *i, char c, char **o) {
 
-  if (i->type == MPC_INPUT_PIPE
-  &&  i->buffer && !mpc_input_buffer_in_range(i)) {
-    i->buffer = realloc(i->buffer, strlen(i->buffer) + 2);
-    i->buffer[strlen(i->buffer) + 1] = '\0';
-    i->buffer[strlen(i->buffer) + 0] = c;
+  if (i->type == MPC_INPUT_PIPE && i->marks_num > 0
+  &&  !mpc_input_buffer_in_range(i)) {
+    mpc_input_buffer_put(i, c);
   }
 
   i->last = c;
@@ -500,18 +977,28 @@ static int mpc_input_range(mpc_input_t *i, char c, char d, char **o) {
   return x >= c && x <= d ? mpc_input_success(i, x, o) : mpc_input_failure(i, x);
 }
 
-static int mpc_input_oneof(mpc_input_t *i, const char *c, char **o) {
-  char x;
-  if (mpc_input_terminated(i)) { return 0; }
-  x = mpc_input_getc(i);
-  return strchr(c, x) != 0 ? mpc_input_success(i, x, o) : mpc_input_failure(i, x);
+/*
+** Character sets are 256 bit membership tables,
+** `oneof` and `noneof` parsers build theirs once
+** so testing a character is a single lookup.
+*/
+
+#define MPC_SET_HAS(set, c) ((set)[(unsigned char)(c) >> 3] & (1 << ((unsigned char)(c) & 7)))
+
+static void mpc_set_init(unsigned char *set, const char *chars, int comp) {
+  int j;
+  memset(set, comp ? 0xFF : 0, 32);
+  for (j = 0; chars[j]; j++) {
+    if (comp) { set[(unsigned char)chars[j] >> 3] &= ~(1 << ((unsigned char)chars[j] & 7)); }
+    else      { set[(unsigned char)chars[j] >> 3] |=  (1 << ((unsigned char)chars[j] & 7)); }
+  }
 }
 
-static int mpc_input_noneof(mpc_input_t *i, const char *c, char **o) {
+static int mpc_input_set(mpc_input_t *i, const unsigned char *set, char **o) {
   char x;
   if (mpc_input_terminated(i)) { return 0; }
   x = mpc_input_getc(i);
-  return strchr(c, x) == 0 ? mpc_input_success(i, x, o) : mpc_input_failure(i, x);
+  return MPC_SET_HAS(set, x) ? mpc_input_success(i, x, o) : mpc_input_failure(i, x);
 }
 
 static int mpc_input_satisfy(mpc_input_t *i, int(*cond)(char), char **o) {
@@ -524,6 +1011,22 @@ static int mpc_input_satisfy(mpc_input_t *i, int(*cond)(char), char **o) {
 static int mpc_input_string(mpc_input_t *i, const char *c, char **o) {
 
   const char *x = c;
+  size_t n;
+
+  /* a string input is compared in place, nothing to rewind on a mismatch */
+  if (i->type == MPC_INPUT_STRING) {
+    n = strlen(c);
+    if ((size_t)(i->length - i->state.pos) < n) {
+      /* the rest of `c` may still be fed to a stream */
+      if (memcmp(i->string + i->state.pos, c, i->length - i->state.pos) == 0) { i->starved = 1; }
+      return 0;
+    }
+    if (memcmp(i->string + i->state.pos, c, n) != 0) { return 0; }
+    for (; *x; x++) { mpc_input_success(i, *x, NULL); }
+    *o = mpc_malloc(i, n + 1);
+    memcpy(*o, c, n + 1);
+    return 1;
+  }
 
   mpc_input_mark(i);
   while (*x) {
@@ -542,6 +1045,7 @@ static int mpc_input_string(mpc_input_t *i, const char *c, char **o) {
 
 static int mpc_input_anchor(mpc_input_t* i, int(*f)(char,char), char **o) {
   *o = NULL;
+  if (i->type == MPC_INPUT_STRING) { mpc_input_end(i); }
   return f(i->last, mpc_input_peekc(i));
 }
 
@@ -665,7 +1169,7 @@ char *mpc_err_string(mpc_err_t *x) {
 
 static mpc_err_t *mpc_err_new(mpc_input_t *i, const char *expected) {
   mpc_err_t *x;
-  if (i->suppress) { return NULL; }
+  if (i->suppress || i->lazy) { return NULL; }
   x = mpc_malloc(i, sizeof(mpc_err_t));
   x->filename = mpc_malloc(i, strlen(i->filename) + 1);
   strcpy(x->filename, i->filename);
@@ -681,7 +1185,7 @@ static mpc_err_t *mpc_err_new(mpc_input_t *i, const char *expected) {
 
 static mpc_err_t *mpc_err_fail(mpc_input_t *i, const char *failure) {
   mpc_err_t *x;
-  if (i->suppress) { return NULL; }
+  if (i->suppress || i->lazy) { return NULL; }
   x = mpc_malloc(i, sizeof(mpc_err_t));
   x->filename = mpc_malloc(i, strlen(i->filename) + 1);
   strcpy(x->filename, i->filename);
@@ -729,6 +1233,32 @@ static mpc_err_t *mpc_err_export(mpc_input_t *i, mpc_err_t *x) {
   return mpc_export(i, x);
 }
 
+static mpc_err_t *mpc_err_copy(mpc_err_t *x) {
+  int j;
+  mpc_err_t *y;
+  if (x == NULL) { return NULL; }
+  y = malloc(sizeof(mpc_err_t));
+  y->state = x->state;
+  y->received = x->received;
+  y->filename = malloc(strlen(x->filename) + 1);
+  strcpy(y->filename, x->filename);
+  y->failure = NULL;
+  if (x->failure) {
+    y->failure = malloc(strlen(x->failure) + 1);
+    strcpy(y->failure, x->failure);
+  }
+  y->expected_num = x->expected_num;
+  y->expected = NULL;
+  if (x->expected_num > 0) {
+    y->expected = malloc(sizeof(char*) * x->expected_num);
+    for (j = 0; j < x->expected_num; j++) {
+      y->expected[j] = malloc(strlen(x->expected[j]) + 1);
+      strcpy(y->expected[j], x->expected[j]);
+    }
+  }
+  return y;
+}
+
 static int mpc_err_contains_expected(mpc_input_t *i, mpc_err_t *x, char *expected) {
   int j;
   (void)i;
@@ -862,6 +1392,7 @@ static mpc_err_t *mpc_err_count(mpc_input_t *i, mpc_err_t *x, int n) {
   mpc_err_t *y;
   int digits = n/10 + 1;
   char *prefix;
+  if (x == NULL) { return NULL; }
   prefix = mpc_malloc(i, digits + strlen(" of ") + 1);
   sprintf(prefix, "%i of ", n);
   y = mpc_err_repeat(i, x, prefix);
@@ -914,7 +1445,9 @@ enum {
   MPC_TYPE_CHECK_WITH = 26,
 
   MPC_TYPE_SOI        = 27,
-  MPC_TYPE_EOI        = 28
+  MPC_TYPE_EOI        = 28,
+
+  MPC_TYPE_DFA        = 29
 };
 
 typedef struct { char *m; } mpc_pdata_fail_t;
@@ -924,7 +1457,7 @@ typedef struct { int(*f)(char,char); } mpc_pdata_anchor_t;
 typedef struct { char x; } mpc_pdata_single_t;
 typedef struct { char x; char y; } mpc_pdata_range_t;
 typedef struct { int(*f)(char); } mpc_pdata_satisfy_t;
-typedef struct { char *x; } mpc_pdata_string_t;
+typedef struct { char *x; unsigned char set[32]; } mpc_pdata_string_t;
 typedef struct { mpc_parser_t *x; mpc_apply_t f; } mpc_pdata_apply_t;
 typedef struct { mpc_parser_t *x; mpc_apply_to_t f; void *d; } mpc_pdata_apply_to_t;
 typedef struct { mpc_parser_t *x; mpc_dtor_t dx; mpc_check_t f; char *e; } mpc_pdata_check_t;
@@ -932,8 +1465,9 @@ typedef struct { mpc_parser_t *x; mpc_dtor_t dx; mpc_check_with_t f; void *d; ch
 typedef struct { mpc_parser_t *x; } mpc_pdata_predict_t;
 typedef struct { mpc_parser_t *x; mpc_dtor_t dx; mpc_ctor_t lf; } mpc_pdata_not_t;
 typedef struct { int n; mpc_fold_t f; mpc_parser_t *x; mpc_dtor_t dx; } mpc_pdata_repeat_t;
-typedef struct { int n; mpc_parser_t **xs; } mpc_pdata_or_t;
+typedef struct { int n; mpc_parser_t **xs; unsigned long *jump; } mpc_pdata_or_t;
 typedef struct { int n; mpc_fold_t f; mpc_parser_t **xs; mpc_dtor_t *dxs;  } mpc_pdata_and_t;
+typedef struct { mpc_parser_t *x; struct mpc_dfa_t *d; } mpc_pdata_dfa_t;
 
 typedef union {
   mpc_pdata_fail_t fail;
@@ -953,6 +1487,7 @@ typedef union {
   mpc_pdata_repeat_t repeat;
   mpc_pdata_and_t and;
   mpc_pdata_or_t or;
+  mpc_pdata_dfa_t dfa;
 } mpc_pdata_t;
 
 struct mpc_parser_t {
@@ -960,6 +1495,12 @@ struct mpc_parser_t {
   mpc_pdata_t data;
   char type;
   char retained;
+  char memo;
+  char ast;
+  int id;
+  long memo_hits;
+  long memo_lookups;
+  struct mpc_prog_t *prog;
 };
 
 static mpc_val_t *mpcf_input_nth_free(mpc_input_t *i, int n, mpc_val_t **xs, int x) {
@@ -974,12 +1515,19 @@ static mpc_val_t *mpcf_input_trd_free(mpc_input_t *i, int n, mpc_val_t **xs) { r
 
 static mpc_val_t *mpcf_input_strfold(mpc_input_t *i, int n, mpc_val_t **xs) {
   int j;
-  size_t l = 0;
+  size_t l = 0, k;
+  char *s;
   if (n == 0) { return mpc_calloc(i, 1, 1); }
   for (j = 0; j < n; j++) { l += strlen(xs[j]); }
-  xs[0] = mpc_realloc(i, xs[0], l + 1);
-  for (j = 1; j < n; j++) { strcat(xs[0], xs[j]); mpc_free(i, xs[j]); }
-  return xs[0];
+  s = mpc_realloc(i, xs[0], l + 1);
+  l = strlen(s);
+  for (j = 1; j < n; j++) {
+    k = strlen(xs[j]);
+    memcpy(s + l, xs[j], k + 1);
+    l += k;
+    mpc_free(i, xs[j]);
+  }
+  return s;
 }
 
 static mpc_val_t *mpcf_input_state_ast(mpc_input_t *i, int n, mpc_val_t **xs) {
@@ -991,6 +1539,57 @@ static mpc_val_t *mpcf_input_state_ast(mpc_input_t *i, int n, mpc_val_t **xs) {
   return a;
 }
 
+static void mpc_ast_delete_no_children(mpc_ast_t *a);
+
+static mpc_val_t *mpcf_input_fold_ast(mpc_input_t *i, int n, mpc_val_t **xs) {
+
+  int j, k, m = 0;
+  mpc_ast_t** as = (mpc_ast_t**)xs;
+  mpc_ast_t *r, *c;
+
+  if (n == 0) { return NULL; }
+  if (n == 1) { return xs[0]; }
+  if (n == 2 && xs[1] == NULL) { return xs[0]; }
+  if (n == 2 && xs[0] == NULL) { return xs[1]; }
+
+  r = mpc_input_ast_new(i, ">", "");
+
+  for (j = 0; j < n; j++) {
+    if (as[j] != NULL) { m += as[j]->children_num >= 2 ? as[j]->children_num : 1; }
+  }
+  mpc_input_ast_children(i, r, m);
+
+  for (j = 0; j < n; j++) {
+
+    if (as[j] == NULL) { continue; }
+
+    if        (as[j]->children_num == 0) {
+      r->children[r->children_num++] = as[j];
+      continue;
+    }
+
+    as[j] = mpc_ast_unshare(as[j]);
+    if (as[j]->children_num == 1) {
+      c = mpc_input_ast_add_tag(i, as[j]->children[0], as[j]->tag, strlen(as[j]->tag)-1, 0);
+      mpc_ast_rule_lift(c, as[j]);
+      r->children[r->children_num++] = c;
+      mpc_ast_delete_no_children(as[j]);
+    } else {
+      for (k = 0; k < as[j]->children_num; k++) {
+        r->children[r->children_num++] = as[j]->children[k];
+      }
+      mpc_ast_delete_no_children(as[j]);
+    }
+
+  }
+
+  if (r->children_num) {
+    r->state = r->children[0]->state;
+  }
+
+  return r;
+}
+
 static mpc_val_t *mpc_parse_fold(mpc_input_t *i, mpc_fold_t f, int n, mpc_val_t **xs) {
   int j;
   if (f == mpcf_null)      { return mpcf_null(n, xs); }
@@ -1002,6 +1601,7 @@ static mpc_val_t *mpc_parse_fold(mpc_input_t *i, mpc_fold_t f, int n, mpc_val_t
   if (f == mpcf_trd_free)  { return mpcf_input_trd_free(i, n, xs); }
   if (f == mpcf_strfold)   { return mpcf_input_strfold(i, n, xs); }
   if (f == mpcf_state_ast) { return mpcf_input_state_ast(i, n, xs); }
+  if (f == mpcf_fold_ast && i->ast) { return mpcf_input_fold_ast(i, n, xs); }
   for (j = 0; j < n; j++) { xs[j] = mpc_export(i, xs[j]); }
   return f(j, xs);
 }
@@ -1012,7 +1612,7 @@ static mpc_val_t *mpcf_input_free(mpc_input_t *i, mpc_val_t *x) {
 }
 
 static mpc_val_t *mpcf_input_str_ast(mpc_input_t *i, mpc_val_t *c) {
-  mpc_ast_t *a = mpc_ast_new("", c);
+  mpc_ast_t *a = i->ast ? mpc_input_ast_new(i, "", c) : mpc_ast_new("", c);
   mpc_free(i, c);
   return a;
 }
@@ -1020,10 +1620,23 @@ static mpc_val_t *mpcf_input_str_ast(mpc_input_t *i, mpc_val_t *c) {
 static mpc_val_t *mpc_parse_apply(mpc_input_t *i, mpc_apply_t f, mpc_val_t *x) {
   if (f == mpcf_free)     { return mpcf_input_free(i, x); }
   if (f == mpcf_str_ast)  { return mpcf_input_str_ast(i, x); }
+  if (f == (mpc_apply_t)mpc_ast_add_root && i->ast) { return mpc_input_ast_add_root(i, x); }
   return f(mpc_export(i, x));
 }
 
+static mpc_ast_t *mpc_input_ast_add_rule(mpc_input_t *i, mpc_ast_t *a, mpc_parser_t *rule) {
+  if (a == NULL) { return a; }
+  a = mpc_input_ast_add_tag(i, a, rule->name, strlen(rule->name), 1);
+  mpc_ast_rule_set(a, rule->id);
+  return a;
+}
+
 static mpc_val_t *mpc_parse_apply_to(mpc_input_t *i, mpc_apply_to_t f, mpc_val_t *x, mpc_val_t *d) {
+  if (i->ast) {
+    if (f == (mpc_apply_to_t)mpc_ast_tag)     { return mpc_input_ast_tag(i, x, d); }
+    if (f == (mpc_apply_to_t)mpc_ast_add_tag) { return mpc_input_ast_add_tag(i, x, d, strlen(d), 1); }
+    if (f == (mpc_apply_to_t)mpc_ast_add_rule) { return mpc_input_ast_add_rule(i, x, d); }
+  }
   return f(mpc_export(i, x), d);
 }
 
@@ -1032,6 +1645,130 @@ static void mpc_parse_dtor(mpc_input_t *i, mpc_dtor_t d, mpc_val_t *x) {
   d(mpc_export(i, x));
 }
 
+#define MPC_MAX_RECURSION_DEPTH 1000
+
+/*
+** a compiled parser goes on in the VM at this depth, see "Parser VM".
+** defining it as 0 runs compiled parsers in the VM from the start
+*/
+#ifndef MPC_VM_DEPTH
+#define MPC_VM_DEPTH (MPC_MAX_RECURSION_DEPTH / 2)
+#endif
+
+/*
+** Regex Automata
+**
+** Regexes built only from character classes
+** and repetitions are also compiled into an
+** automaton with one state per class test.
+** Repetitions in mpc are greedy and never give
+** back input, so at most one transition applies
+** to every character and matching is a single
+** table driven loop over the string.
+**
+** A state either consumes a character in its
+** set and moves to `match`, or merges its
+** expected error and moves to `skip`, or fails.
+** This mirrors the errors the combinators build
+** for the same regex. The combinators are kept
+** in `x` for inputs that are not strings.
+*/
+
+enum {
+  MPC_DFA_SKIP  = 0,
+  MPC_DFA_FAIL  = 1,
+  MPC_DFA_MANY1 = 2,
+  MPC_DFA_COUNT = 3
+};
+
+typedef struct {
+  unsigned char set[32];
+  int match;
+  int skip;
+  int fail;
+  int n;
+  char *expected;
+} mpc_dfa_state_t;
+
+struct mpc_dfa_t {
+  int rewind;
+  int height;
+  int states_num;
+  mpc_dfa_state_t *states;
+};
+
+static void mpc_dfa_delete(struct mpc_dfa_t *d) {
+  int j;
+  for (j = 0; j < d->states_num; j++) { free(d->states[j].expected); }
+  free(d->states);
+  free(d);
+}
+
+static struct mpc_dfa_t *mpc_dfa_copy(struct mpc_dfa_t *a) {
+  int j;
+  struct mpc_dfa_t *d = malloc(sizeof(struct mpc_dfa_t));
+  memcpy(d, a, sizeof(struct mpc_dfa_t));
+  d->states = malloc(sizeof(mpc_dfa_state_t) * a->states_num);
+  memcpy(d->states, a->states, sizeof(mpc_dfa_state_t) * a->states_num);
+  for (j = 0; j < a->states_num; j++) {
+    d->states[j].expected = malloc(strlen(a->states[j].expected) + 1);
+    strcpy(d->states[j].expected, a->states[j].expected);
+  }
+  return d;
+}
+
+/* near the depth limit the combinators fail where the automaton would not */
+static int mpc_dfa_applies(mpc_input_t *i, struct mpc_dfa_t *d, int depth) {
+  return i->type == MPC_INPUT_STRING && depth + d->height <= MPC_MAX_RECURSION_DEPTH;
+}
+
+/* copy of the string input consumed since `start` */
+static char *mpc_input_slice(mpc_input_t *i, long start) {
+  char *x = mpc_malloc(i, i->state.pos - start + 1);
+  memcpy(x, i->string + start, i->state.pos - start);
+  x[i->state.pos - start] = '\0';
+  return x;
+}
+
+static int mpc_dfa_run(mpc_input_t *i, struct mpc_dfa_t *d, mpc_result_t *r, mpc_err_t **e) {
+
+  int s = 0;
+  char c, last = i->last;
+  mpc_state_t start = i->state;
+  mpc_dfa_state_t *q;
+
+  while (s < d->states_num) {
+
+    q = &d->states[s];
+
+    if (!mpc_input_end(i) && MPC_SET_HAS(q->set, i->string[i->state.pos])) {
+      c = i->string[i->state.pos];
+      mpc_input_success(i, c, NULL);
+      s = q->match;
+      continue;
+    }
+
+    switch (q->fail) {
+      case MPC_DFA_SKIP:
+        *e = mpc_err_merge(i, *e, mpc_err_new(i, q->expected));
+        s = q->skip;
+        continue;
+      case MPC_DFA_FAIL:  r->error = mpc_err_new(i, q->expected); break;
+      case MPC_DFA_MANY1: r->error = mpc_err_many1(i, mpc_err_new(i, q->expected)); break;
+      default:            r->error = mpc_err_count(i, mpc_err_new(i, q->expected), q->n); break;
+    }
+
+    if (d->rewind && i->backtrack > 0) {
+      i->state = start;
+      i->last = last;
+    }
+    return 0;
+  }
+
+  r->output = mpc_input_slice(i, start.pos);
+  return 1;
+}
+
 enum {
   MPC_PARSE_STACK_MIN = 4
 };
@@ -1042,9 +1779,142 @@ enum {
   if (x) { MPC_SUCCESS(r->output); } \
   else { MPC_FAILURE(NULL); }
 
-#define MPC_MAX_RECURSION_DEPTH 1000
+static mpc_ast_t *mpc_ast_share(mpc_ast_t *a);
 
-static int mpc_parse_run(mpc_input_t *i, mpc_parser_t *p, mpc_result_t *r, mpc_err_t **e, int depth) {
+static int mpc_parse_memo(mpc_input_t *i, mpc_parser_t *p, mpc_result_t *r, mpc_err_t **e, int depth);
+
+static int mpc_parse_run(mpc_input_t *i, mpc_parser_t *p, mpc_result_t *r, mpc_err_t **e, int depth);
+
+struct mpc_prog_t;
+static int mpc_prog_find(struct mpc_prog_t *prog, mpc_parser_t *p);
+static int mpc_vm_run(mpc_input_t *i, struct mpc_prog_t *prog, int pc, mpc_result_t *r, mpc_err_t **e);
+
+/*
+** `many` of a character set folded with
+** `mpcf_strfold`, such as runs of whitespace or
+** digits, scans a string input in one loop. The
+** error merged at the end of the run is the one
+** the failing repetition would have produced.
+*/
+
+static int mpc_many_set(mpc_input_t *i, mpc_pdata_repeat_t *d, int depth) {
+  mpc_parser_t *x = d->x;
+  int height = 1;
+  if (i->type != MPC_INPUT_STRING || d->f != mpcf_strfold || x->memo) { return 0; }
+  if (x->type == MPC_TYPE_EXPECT) {
+    x = x->data.expect.x;
+    height++;
+  }
+  return (x->type == MPC_TYPE_ONEOF || x->type == MPC_TYPE_NONEOF)
+    && !x->memo && depth + height < MPC_MAX_RECURSION_DEPTH;
+}
+
+/*
+** With SSE2 a set of at most 16 characters, or
+** all but at most 16 as in `noneof("\n")`, is
+** tested 16 bytes at a time by comparing them
+** with each of its characters. The last bytes,
+** and larger sets, go through the lookup table.
+*/
+
+enum {
+  MPC_SPAN_CHARS = 16
+};
+
+static long mpc_set_span(mpc_parser_t *x, const char *s, long n) {
+
+  long k = 0;
+#ifdef __SSE2__
+  const char *chars = x->data.string.x;
+  __m128i want[MPC_SPAN_CHARS], hit, b;
+  int j, m, mask;
+#endif
+
+  /* most runs of whitespace are one space long */
+  if (n == 0 || !MPC_SET_HAS(x->data.string.set, s[0])) { return 0; }
+
+#ifdef __SSE2__
+  for (m = 0; m < MPC_SPAN_CHARS && chars[m]; m++) {
+    want[m] = _mm_set1_epi8(chars[m]);
+  }
+
+  if (!chars[m]) {
+    while (k + 16 <= n) {
+      b = _mm_loadu_si128((const __m128i *)(s + k));
+      hit = _mm_setzero_si128();
+      for (j = 0; j < m; j++) {
+        hit = _mm_or_si128(hit, _mm_cmpeq_epi8(b, want[j]));
+      }
+      mask = _mm_movemask_epi8(hit);
+      if (x->type == MPC_TYPE_ONEOF) { mask = ~mask & 0xFFFF; }
+      if (mask) { break; }
+      k += 16;
+    }
+  }
+#endif
+
+  while (k < n && MPC_SET_HAS(x->data.string.set, s[k])) { k++; }
+  return k;
+}
+
+static int mpc_parse_many_set(mpc_input_t *i, mpc_pdata_repeat_t *d, int many1, mpc_result_t *r, mpc_err_t **e) {
+
+  mpc_parser_t *x = d->x->type == MPC_TYPE_EXPECT ? d->x->data.expect.x : d->x;
+  long start = i->state.pos;
+  long n = mpc_set_span(x, i->string + start, i->length - start);
+  const char *s = i->string + start, *nl;
+  mpc_err_t *err;
+
+  /* the same bookkeeping as n calls to mpc_input_success */
+  if (n > 0) {
+    i->last = s[n - 1];
+    i->state.pos += n;
+    i->state.col += n;
+    nl = memchr(s, '\n', n);
+    while (nl) {
+      i->state.row++;
+      i->state.col = (s + n) - (nl + 1);
+      nl = memchr(nl + 1, '\n', (s + n) - (nl + 1));
+    }
+  }
+  mpc_input_end(i);
+
+  err = d->x->type == MPC_TYPE_EXPECT ? mpc_err_new(i, d->x->data.expect.m) : NULL;
+
+  if (many1 && i->state.pos == start) {
+    r->error = mpc_err_many1(i, err);
+    return 0;
+  }
+
+  *e = mpc_err_merge(i, *e, err);
+  r->output = mpc_input_slice(i, start);
+  return 1;
+}
+
+/*
+** With the jump table built by `mpc_analyse`
+** an `or` only tries the alternatives that can
+** start with the next character. The skipped
+** ones would fail without consuming anything,
+** so the result is unchanged. Only their errors
+** are missing, which the lazy pass over a string
+** does not build anyway.
+*/
+
+enum {
+  MPC_JUMP_MAX = 32,
+  MPC_JUMP_EOI = 256
+};
+
+static int mpc_or_next(mpc_input_t *i, mpc_pdata_or_t *d, int j) {
+  unsigned long viable;
+  if (d->jump == NULL || !i->lazy) { return j; }
+  viable = d->jump[mpc_input_end(i) ? MPC_JUMP_EOI : (unsigned char)i->string[i->state.pos]];
+  while (j < d->n && !(viable & (1UL << j))) { j++; }
+  return j;
+}
+
+static int mpc_parse_node(mpc_input_t *i, mpc_parser_t *p, mpc_result_t *r, mpc_err_t **e, int depth) {
 
   int j = 0, k = 0;
   mpc_result_t results_stk[MPC_PARSE_STACK_MIN];
@@ -1063,8 +1933,8 @@ static int mpc_parse_run(mpc_input_t *i, mpc_parser_t *p, mpc_result_t *r, mpc_e
     case MPC_TYPE_ANY:     MPC_PRIMITIVE(mpc_input_any(i, (char**)&r->output));
     case MPC_TYPE_SINGLE:  MPC_PRIMITIVE(mpc_input_char(i, p->data.single.x, (char**)&r->output));
     case MPC_TYPE_RANGE:   MPC_PRIMITIVE(mpc_input_range(i, p->data.range.x, p->data.range.y, (char**)&r->output));
-    case MPC_TYPE_ONEOF:   MPC_PRIMITIVE(mpc_input_oneof(i, p->data.string.x, (char**)&r->output));
-    case MPC_TYPE_NONEOF:  MPC_PRIMITIVE(mpc_input_noneof(i, p->data.string.x, (char**)&r->output));
+    case MPC_TYPE_ONEOF:   MPC_PRIMITIVE(mpc_input_set(i, p->data.string.set, (char**)&r->output));
+    case MPC_TYPE_NONEOF:  MPC_PRIMITIVE(mpc_input_set(i, p->data.string.set, (char**)&r->output));
     case MPC_TYPE_SATISFY: MPC_PRIMITIVE(mpc_input_satisfy(i, p->data.satisfy.f, (char**)&r->output));
     case MPC_TYPE_STRING:  MPC_PRIMITIVE(mpc_input_string(i, p->data.string.x, (char**)&r->output));
     case MPC_TYPE_ANCHOR:  MPC_PRIMITIVE(mpc_input_anchor(i, p->data.anchor.f, (char**)&r->output));
@@ -1170,6 +2040,10 @@ static int mpc_parse_run(mpc_input_t *i, mpc_parser_t *p, mpc_result_t *r, mpc_e
 
     case MPC_TYPE_MANY:
 
+      if (mpc_many_set(i, &p->data.repeat, depth)) {
+        return mpc_parse_many_set(i, &p->data.repeat, 0, r, e);
+      }
+
       results = results_stk;
 
       while (mpc_parse_run(i, p->data.repeat.x, &results[j], e, depth+1)) {
@@ -1192,6 +2066,10 @@ static int mpc_parse_run(mpc_input_t *i, mpc_parser_t *p, mpc_result_t *r, mpc_e
 
     case MPC_TYPE_MANY1:
 
+      if (mpc_many_set(i, &p->data.repeat, depth)) {
+        return mpc_parse_many_set(i, &p->data.repeat, 1, r, e);
+      }
+
       results = results_stk;
 
       while (mpc_parse_run(i, p->data.repeat.x, &results[j], e, depth+1)) {
@@ -1206,115 +2084,823 @@ static int mpc_parse_run(mpc_input_t *i, mpc_parser_t *p, mpc_result_t *r, mpc_e
         }
       }
 
-      if (j == 0) {
-        MPC_FAILURE(
-          mpc_err_many1(i, results[j].error);
-          if (j >= MPC_PARSE_STACK_MIN) { mpc_free(i, results); });
-      } else {
+      if (j == 0) {
+        MPC_FAILURE(
+          mpc_err_many1(i, results[j].error);
+          if (j >= MPC_PARSE_STACK_MIN) { mpc_free(i, results); });
+      } else {
+
+        *e = mpc_err_merge(i, *e, results[j].error);
+
+        MPC_SUCCESS(
+          mpc_parse_fold(i, p->data.repeat.f, j, (mpc_val_t**)results);
+          if (j >= MPC_PARSE_STACK_MIN) { mpc_free(i, results); });
+      }
+
+    case MPC_TYPE_COUNT:
+
+      results = p->data.repeat.n > MPC_PARSE_STACK_MIN
+        ? mpc_malloc(i, sizeof(mpc_result_t) * p->data.repeat.n)
+        : results_stk;
+
+      while (mpc_parse_run(i, p->data.repeat.x, &results[j], e, depth+1)) {
+        j++;
+        if (j == p->data.repeat.n) { break; }
+      }
+
+      if (j == p->data.repeat.n) {
+        MPC_SUCCESS(
+          mpc_parse_fold(i, p->data.repeat.f, j, (mpc_val_t**)results);
+          if (p->data.repeat.n > MPC_PARSE_STACK_MIN) { mpc_free(i, results); });
+      } else {
+        for (k = 0; k < j; k++) {
+          mpc_parse_dtor(i, p->data.repeat.dx, results[k].output);
+        }
+        MPC_FAILURE(
+          mpc_err_count(i, results[j].error, p->data.repeat.n);
+          if (p->data.repeat.n > MPC_PARSE_STACK_MIN) { mpc_free(i, results); });
+      }
+
+    /* Combinatory Parsers */
+
+    case MPC_TYPE_OR:
+
+      if (p->data.or.n == 0) { MPC_SUCCESS(NULL); }
+
+      results = p->data.or.n > MPC_PARSE_STACK_MIN
+        ? mpc_malloc(i, sizeof(mpc_result_t) * p->data.or.n)
+        : results_stk;
+
+      for (j = mpc_or_next(i, &p->data.or, 0); j < p->data.or.n; j = mpc_or_next(i, &p->data.or, j+1)) {
+        if (mpc_parse_run(i, p->data.or.xs[j], &results[j], e, depth+1)) {
+          MPC_SUCCESS(results[j].output;
+            if (p->data.or.n > MPC_PARSE_STACK_MIN) { mpc_free(i, results); });
+        } else {
+          *e = mpc_err_merge(i, *e, results[j].error);
+        }
+      }
+
+      MPC_FAILURE(NULL;
+        if (p->data.or.n > MPC_PARSE_STACK_MIN) { mpc_free(i, results); });
+
+    case MPC_TYPE_AND:
+
+      if (p->data.and.n == 0) { MPC_SUCCESS(NULL); }
+
+      results = p->data.or.n > MPC_PARSE_STACK_MIN
+        ? mpc_malloc(i, sizeof(mpc_result_t) * p->data.or.n)
+        : results_stk;
+
+      mpc_input_mark(i);
+      for (j = 0; j < p->data.and.n; j++) {
+        if (!mpc_parse_run(i, p->data.and.xs[j], &results[j], e, depth+1)) {
+          mpc_input_rewind(i);
+          for (k = 0; k < j; k++) {
+            mpc_parse_dtor(i, p->data.and.dxs[k], results[k].output);
+          }
+          MPC_FAILURE(results[j].error;
+            if (p->data.or.n > MPC_PARSE_STACK_MIN) { mpc_free(i, results); });
+        }
+      }
+      mpc_input_unmark(i);
+      MPC_SUCCESS(
+        mpc_parse_fold(i, p->data.and.f, j, (mpc_val_t**)results);
+        if (p->data.or.n > MPC_PARSE_STACK_MIN) { mpc_free(i, results); });
+
+    /* Regex Automata */
+
+    case MPC_TYPE_DFA:
+      if (mpc_dfa_applies(i, p->data.dfa.d, depth)) {
+        return mpc_dfa_run(i, p->data.dfa.d, r, e);
+      }
+      return mpc_parse_run(i, p->data.dfa.x, r, e, depth);
+
+    /* End */
+
+    default:
+
+      MPC_FAILURE(mpc_err_fail(i, "Unknown Parser Type Id!"));
+  }
+
+  return 0;
+
+}
+
+#undef MPC_SUCCESS
+#undef MPC_FAILURE
+#undef MPC_PRIMITIVE
+
+static int mpc_parse_run(mpc_input_t *i, mpc_parser_t *p, mpc_result_t *r, mpc_err_t **e, int depth) {
+  int pc;
+  if (depth == MPC_VM_DEPTH && i->prog && (pc = mpc_prog_find(i->prog, p)) >= 0) {
+    return mpc_vm_run(i, i->prog, pc, r, e);
+  }
+  if (p->memo && i->type == MPC_INPUT_STRING) {
+    return mpc_parse_memo(i, p, r, e, depth);
+  }
+  return mpc_parse_node(i, p, r, e, depth);
+}
+
+static size_t mpc_memo_hash(mpc_parser_t *p, long pos, int flags) {
+  size_t h = (size_t)p / sizeof(mpc_parser_t);
+  h = h * 31 + (size_t)pos;
+  h = h * 4 + (size_t)flags;
+  return (h * 2654435761u) % MPC_INPUT_MEMO_NUM;
+}
+
+/*
+** The result of a memoised parser depends on
+** the position, whether errors are suppressed
+** and whether backtracking is enabled. Besides
+** its result a parse also merges errors into the
+** furthest error `e`, so that contribution is
+** collected separately and replayed on a hit.
+*/
+
+static mpc_memo_t *mpc_memo_find(mpc_input_t *i, mpc_parser_t *p, int *flags, int *seen) {
+
+  long pos = i->state.pos;
+  mpc_memo_t *m;
+
+  if (i->memo == NULL) {
+    i->memo = calloc(MPC_INPUT_MEMO_NUM, sizeof(mpc_memo_t));
+  }
+
+  *flags = (i->suppress > 0) | ((i->backtrack > 0) << 1);
+  m = &i->memo[mpc_memo_hash(p, pos, *flags)];
+  *seen = m->parser == p && m->pos == pos && m->flags == *flags;
+  if (i->stats) { p->memo_lookups++; }
+  return m;
+}
+
+static int mpc_memo_replay(mpc_input_t *i, mpc_parser_t *p, mpc_memo_t *m, mpc_result_t *r, mpc_err_t **e) {
+  if (i->stats) { p->memo_hits++; }
+  i->state = m->state;
+  i->last = m->last;
+  if (m->merged) { *e = mpc_err_merge(i, *e, mpc_err_copy(m->merged)); }
+  if (m->kind == MPC_MEMO_SUCCESS) {
+    r->output = mpc_ast_share(m->output);
+    return 1;
+  }
+  r->error = mpc_err_copy(m->error);
+  return 0;
+}
+
+static void mpc_memo_store(mpc_input_t *i, mpc_parser_t *p, long pos, int flags, int seen, int x, mpc_result_t *r, mpc_err_t *inner) {
+
+  /* nested parses may have replaced the entry in the meantime */
+  mpc_memo_t *m = &i->memo[mpc_memo_hash(p, pos, flags)];
+  mpc_memo_clear(m);
+  m->parser = p;
+  m->pos = pos;
+  m->flags = flags;
+  m->kind = MPC_MEMO_SEEN;
+
+  if (!x || seen) {
+    m->kind = x ? MPC_MEMO_SUCCESS : MPC_MEMO_FAILURE;
+    m->state = i->state;
+    m->last = i->last;
+    m->output = x ? mpc_ast_share(r->output) : NULL;
+    m->error = x ? NULL : mpc_err_copy(r->error);
+    m->merged = mpc_err_copy(inner);
+  }
+}
+
+static int mpc_parse_memo(mpc_input_t *i, mpc_parser_t *p, mpc_result_t *r, mpc_err_t **e, int depth) {
+
+  int x, flags, seen;
+  long pos = i->state.pos;
+  mpc_err_t *inner = NULL;
+  mpc_memo_t *m = mpc_memo_find(i, p, &flags, &seen);
+
+  if (seen && m->kind != MPC_MEMO_SEEN) {
+    return mpc_memo_replay(i, p, m, r, e);
+  }
+
+  x = mpc_parse_node(i, p, r, &inner, depth);
+  mpc_memo_store(i, p, pos, flags, seen, x, r, inner);
+  if (inner) { *e = mpc_err_merge(i, *e, inner); }
+
+  return x;
+}
+
+/*
+** Parser VM
+*/
+
+/*
+** `mpc_compile` lowers a parser graph into a
+** flat array of instructions. Each instruction
+** holds a copy of its node's data and refers
+** to its children by index.
+**
+** The VM replaces the recursion of
+** `mpc_parse_run` with an explicit stack of
+** frames. A frame is entered once and then
+** resumed every time one of its children
+** returns, with the child's result in `ret`.
+** Backtracking still goes through the input
+** marks, so results and errors are exactly those
+** of the recursive parser.
+**
+** Instructions that can't reach themselves
+** again, such as a regex or a rule made only of
+** tokens, are run by the recursive parser in the
+** frame of their parent, and a chain of nodes
+** with one child shares a frame. The frames left
+** are those of the rules that nest, so the stack
+** grows with the nesting of the input and is
+** limited by the heap rather than by
+** `MPC_MAX_RECURSION_DEPTH`.
+**
+** Frames cost more than the calls of the
+** recursive parser: run from the start, the VM
+** takes about two and a half times as long on
+** shallow input. So a compiled parser starts out
+** recursive and only moves a subtree into the VM
+** once it is `MPC_VM_DEPTH` deep. The VM is there
+** so that deep input parses at all, not to make
+** parsing faster.
+*/
+
+#define MPC_VM_LEAF_HEIGHT 64
+
+typedef struct {
+  char type;
+  char memo;
+  char leaf;
+  int n;
+  int xs;
+  mpc_pdata_t data;
+  mpc_parser_t *parser;
+} mpc_inst_t;
+
+struct mpc_prog_t {
+  int code_num;
+  mpc_inst_t *code;
+  int args_num;
+  int *args;
+  int slots;
+  mpc_parser_t **table;
+  int *ids;
+};
+
+/* the frame of the first node of a chain is `top`, the one running is `pc` */
+typedef struct {
+  int pc;
+  int top;
+  int resumed;
+  int j;
+  int slots;
+  /* frames whose error accumulators this frame and its parent use, -1 for the top one */
+  int eo;
+  int peo;
+  int memo;
+  int memo_flags;
+  int memo_seen;
+  long memo_pos;
+  mpc_err_t *inner;
+  mpc_result_t *results;
+  mpc_result_t local[MPC_PARSE_STACK_MIN];
+} mpc_frame_t;
+
+static int mpc_compile_children(mpc_parser_t *p, mpc_parser_t ***xs) {
+  switch (p->type) {
+    case MPC_TYPE_APPLY:      *xs = &p->data.apply.x; return 1;
+    case MPC_TYPE_APPLY_TO:   *xs = &p->data.apply_to.x; return 1;
+    case MPC_TYPE_CHECK:      *xs = &p->data.check.x; return 1;
+    case MPC_TYPE_CHECK_WITH: *xs = &p->data.check_with.x; return 1;
+    case MPC_TYPE_EXPECT:     *xs = &p->data.expect.x; return 1;
+    case MPC_TYPE_PREDICT:    *xs = &p->data.predict.x; return 1;
+    case MPC_TYPE_NOT:
+    case MPC_TYPE_MAYBE:      *xs = &p->data.not.x; return 1;
+    case MPC_TYPE_MANY:
+    case MPC_TYPE_MANY1:
+    case MPC_TYPE_COUNT:      *xs = &p->data.repeat.x; return 1;
+    case MPC_TYPE_OR:         *xs = p->data.or.xs; return p->data.or.n;
+    case MPC_TYPE_AND:        *xs = p->data.and.xs; return p->data.and.n;
+    case MPC_TYPE_DFA:        *xs = &p->data.dfa.x; return 1;
+    default:                  *xs = NULL; return 0;
+  }
+}
+
+/* index of a parser in the program, adding it to the table when new */
+static int mpc_compile_index(mpc_parser_t ***table, int **ids, int *slots, int *num, mpc_parser_t *p) {
+
+  size_t h;
+  int k;
+
+  if (*num * 2 >= *slots) {
+    mpc_parser_t **old = *table;
+    int *old_ids = *ids;
+    int old_slots = *slots;
+    *slots = *slots * 2;
+    *table = calloc(*slots, sizeof(mpc_parser_t*));
+    *ids = malloc(sizeof(int) * *slots);
+    for (k = 0; k < old_slots; k++) {
+      if (old[k] == NULL) { continue; }
+      h = ((size_t)old[k] / sizeof(mpc_parser_t)) % *slots;
+      while ((*table)[h] != NULL) { h = (h + 1) % *slots; }
+      (*table)[h] = old[k];
+      (*ids)[h] = old_ids[k];
+    }
+    free(old);
+    free(old_ids);
+  }
+
+  h = ((size_t)p / sizeof(mpc_parser_t)) % *slots;
+  while ((*table)[h] != NULL) {
+    if ((*table)[h] == p) { return (*ids)[h]; }
+    h = (h + 1) % *slots;
+  }
+
+  (*table)[h] = p;
+  (*ids)[h] = (*num)++;
+  return -1;
+}
+
+static void mpc_prog_delete(struct mpc_prog_t *prog) {
+  if (prog == NULL) { return; }
+  free(prog->code);
+  free(prog->args);
+  free(prog->table);
+  free(prog->ids);
+  free(prog);
+}
+
+/* instruction of parser `p`, -1 when it is not part of the program */
+static int mpc_prog_find(struct mpc_prog_t *prog, mpc_parser_t *p) {
+  size_t h = ((size_t)p / sizeof(mpc_parser_t)) % prog->slots;
+  while (prog->table[h] != NULL) {
+    if (prog->table[h] == p) { return prog->ids[h]; }
+    h = (h + 1) % prog->slots;
+  }
+  return -1;
+}
+
+/*
+** Finds the height of every instruction whose
+** graph has no cycle by assigning heights until
+** nothing changes. Those never given one reach
+** a cycle and keep their frames.
+*/
+
+static void mpc_prog_leaves(struct mpc_prog_t *prog) {
+
+  int *height = malloc(sizeof(int) * prog->code_num);
+  int changed = 1, j, k, h;
+  mpc_inst_t *c;
+
+  for (j = 0; j < prog->code_num; j++) { height[j] = -1; }
+
+  while (changed) {
+    changed = 0;
+    for (j = 0; j < prog->code_num; j++) {
+      c = &prog->code[j];
+      if (height[j] >= 0) { continue; }
+      for (h = 1, k = 0; k < c->n; k++) {
+        if (height[prog->args[c->xs + k]] < 0) { break; }
+        if (height[prog->args[c->xs + k]] + 1 > h) { h = height[prog->args[c->xs + k]] + 1; }
+      }
+      if (k == c->n) {
+        height[j] = h;
+        changed = 1;
+      }
+    }
+  }
+
+  for (j = 0; j < prog->code_num; j++) {
+    prog->code[j].leaf = height[j] >= 0 && height[j] <= MPC_VM_LEAF_HEIGHT;
+  }
+
+  free(height);
+}
+
+static struct mpc_prog_t *mpc_prog_new(mpc_parser_t *p) {
+
+  int slots = 64, num = 0, queue_num = 0, k, n, id;
+  mpc_parser_t **table = calloc(slots, sizeof(mpc_parser_t*));
+  int *ids = malloc(sizeof(int) * slots);
+  mpc_parser_t **queue = NULL, **xs;
+  struct mpc_prog_t *prog = calloc(1, sizeof(struct mpc_prog_t));
+
+  /* number the nodes breadth first, the root becomes instruction 0 */
+  mpc_compile_index(&table, &ids, &slots, &num, p);
+  queue = realloc(queue, sizeof(mpc_parser_t*) * num);
+  queue[queue_num++] = p;
+
+  for (id = 0; id < queue_num; id++) {
+
+    mpc_parser_t *q = queue[id];
+    mpc_inst_t *inst;
+
+    n = mpc_compile_children(q, &xs);
+
+    prog->code = realloc(prog->code, sizeof(mpc_inst_t) * (id + 1));
+    prog->args = realloc(prog->args, sizeof(int) * (prog->args_num + n + 1));
+    inst = &prog->code[id];
+    inst->type = q->type;
+    inst->memo = q->memo;
+    inst->n = n;
+    inst->xs = prog->args_num;
+    inst->data = q->data;
+    inst->parser = q;
+
+    for (k = 0; k < n; k++) {
+      int x = mpc_compile_index(&table, &ids, &slots, &num, xs[k]);
+      if (x < 0) {
+        x = num - 1;
+        queue = realloc(queue, sizeof(mpc_parser_t*) * num);
+        queue[queue_num++] = xs[k];
+      }
+      prog->args[prog->args_num++] = x;
+    }
+  }
+
+  prog->code_num = queue_num;
+  prog->slots = slots;
+  prog->table = table;
+  prog->ids = ids;
+  mpc_prog_leaves(prog);
+
+  free(queue);
+
+  return prog;
+}
+
+void mpc_compile(mpc_parser_t *p) {
+  struct mpc_prog_t *prog = mpc_prog_new(p);
+  mpc_prog_delete(p->prog);
+  p->prog = prog;
+}
+
+static mpc_result_t *mpc_frame_results(mpc_frame_t *f) {
+  return f->results ? f->results : f->local;
+}
+
+/* make room for one more result after `j` */
+static void mpc_frame_grow(mpc_input_t *i, mpc_frame_t *f) {
+  if (f->j == MPC_PARSE_STACK_MIN) {
+    f->slots = f->j + f->j / 2;
+    f->results = mpc_malloc(i, sizeof(mpc_result_t) * f->slots);
+    memcpy(f->results, f->local, sizeof(mpc_result_t) * MPC_PARSE_STACK_MIN);
+  } else if (f->j >= f->slots) {
+    f->slots = f->j + f->j / 2;
+    f->results = mpc_realloc(i, f->results, sizeof(mpc_result_t) * f->slots);
+  }
+}
+
+static void mpc_frame_free(mpc_input_t *i, mpc_frame_t *f) {
+  if (f->results) { mpc_free(i, f->results); }
+}
+
+static int mpc_vm_run(mpc_input_t *i, struct mpc_prog_t *prog, int pc, mpc_result_t *r, mpc_err_t **e) {
 
-        *e = mpc_err_merge(i, *e, results[j].error);
+  int num = 0, slots = 64, ok = 0, k;
+  mpc_frame_t *stk = malloc(sizeof(mpc_frame_t) * slots);
+  mpc_frame_t *f;
+  mpc_inst_t *c;
+  mpc_err_t **fe;
+  mpc_result_t ret;
+  mpc_memo_t *m;
 
-        MPC_SUCCESS(
-          mpc_parse_fold(i, p->data.repeat.f, j, (mpc_val_t**)results);
-          if (j >= MPC_PARSE_STACK_MIN) { mpc_free(i, results); });
-      }
+  /* run a leaf in place or start a frame for instruction pc, which is entered next */
+#define MPC_VM_CALL(pc_) \
+  if (prog->code[(pc_)].leaf) { ok = mpc_parse_run(i, prog->code[(pc_)].parser, &ret, fe, 0); goto resume; } \
+  if (num == slots) { slots *= 2; stk = realloc(stk, sizeof(mpc_frame_t) * slots); f = &stk[num-1]; } \
+  stk[num].pc = (pc_); stk[num].top = (pc_); stk[num].resumed = 0; stk[num].j = 0; stk[num].results = NULL; \
+  stk[num].eo = stk[num-1].eo; stk[num].peo = stk[num].eo; stk[num].memo = 0; \
+  num++; continue
 
-    case MPC_TYPE_COUNT:
+/* go on with the only child in this frame, unless either of them is memoised */
+#define MPC_VM_CHAIN(pc_) \
+  if (!f->memo && !prog->code[(pc_)].memo && !prog->code[(pc_)].leaf) { f->pc = (pc_); f->resumed = 0; continue; } \
+  MPC_VM_CALL(pc_)
 
-      results = p->data.repeat.n > MPC_PARSE_STACK_MIN
-        ? mpc_malloc(i, sizeof(mpc_result_t) * p->data.repeat.n)
-        : results_stk;
+#define MPC_VM_CHILD(k_) prog->args[c->xs + (k_)]
+#define MPC_VM_CHILD_OF(pc_) prog->args[prog->code[(pc_)].xs]
+#define MPC_VM_SUCCESS(x_) ret.output = (x_); ok = 1; goto done
+#define MPC_VM_FAILURE(x_) ret.error = (x_); ok = 0; goto done
+#define MPC_VM_PRIMITIVE(x_) \
+  if (x_) { ok = 1; goto done; } \
+  else { MPC_VM_FAILURE(NULL); }
 
-      while (mpc_parse_run(i, p->data.repeat.x, &results[j], e, depth+1)) {
-        j++;
-        if (j == p->data.repeat.n) { break; }
-      }
+  stk[0].pc = pc; stk[0].top = pc; stk[0].resumed = 0; stk[0].j = 0; stk[0].results = NULL;
+  stk[0].eo = -1; stk[0].peo = -1; stk[0].memo = 0;
+  num = 1;
 
-      if (j == p->data.repeat.n) {
-        MPC_SUCCESS(
-          mpc_parse_fold(i, p->data.repeat.f, j, (mpc_val_t**)results);
-          if (p->data.repeat.n > MPC_PARSE_STACK_MIN) { mpc_free(i, results); });
-      } else {
-        for (k = 0; k < j; k++) {
-          mpc_parse_dtor(i, p->data.repeat.dx, results[k].output);
+  while (num > 0) {
+
+    f = &stk[num-1];
+    c = &prog->code[f->pc];
+    fe = f->eo < 0 ? e : &stk[f->eo].inner;
+
+    if (!f->resumed) {
+
+      f->resumed = 1;
+
+      if (c->memo && i->type == MPC_INPUT_STRING) {
+        m = mpc_memo_find(i, c->parser, &f->memo_flags, &f->memo_seen);
+        if (f->memo_seen && m->kind != MPC_MEMO_SEEN) {
+          ok = mpc_memo_replay(i, c->parser, m, &ret, fe);
+          goto done;
         }
-        MPC_FAILURE(
-          mpc_err_count(i, results[j].error, p->data.repeat.n);
-          if (p->data.repeat.n > MPC_PARSE_STACK_MIN) { mpc_free(i, results); });
+        f->memo = 1;
+        f->memo_pos = i->state.pos;
+        f->inner = NULL;
+        f->eo = num - 1;
+        fe = &f->inner;
       }
 
-    /* Combinatory Parsers */
-
-    case MPC_TYPE_OR:
+      switch (c->type) {
+
+        case MPC_TYPE_ANY:     MPC_VM_PRIMITIVE(mpc_input_any(i, (char**)&ret.output));
+        case MPC_TYPE_SINGLE:  MPC_VM_PRIMITIVE(mpc_input_char(i, c->data.single.x, (char**)&ret.output));
+        case MPC_TYPE_RANGE:   MPC_VM_PRIMITIVE(mpc_input_range(i, c->data.range.x, c->data.range.y, (char**)&ret.output));
+        case MPC_TYPE_ONEOF:   MPC_VM_PRIMITIVE(mpc_input_set(i, c->data.string.set, (char**)&ret.output));
+        case MPC_TYPE_NONEOF:  MPC_VM_PRIMITIVE(mpc_input_set(i, c->data.string.set, (char**)&ret.output));
+        case MPC_TYPE_SATISFY: MPC_VM_PRIMITIVE(mpc_input_satisfy(i, c->data.satisfy.f, (char**)&ret.output));
+        case MPC_TYPE_STRING:  MPC_VM_PRIMITIVE(mpc_input_string(i, c->data.string.x, (char**)&ret.output));
+        case MPC_TYPE_ANCHOR:  MPC_VM_PRIMITIVE(mpc_input_anchor(i, c->data.anchor.f, (char**)&ret.output));
+        case MPC_TYPE_SOI:     MPC_VM_PRIMITIVE(mpc_input_soi(i, (char**)&ret.output));
+        case MPC_TYPE_EOI:     MPC_VM_PRIMITIVE(mpc_input_eoi(i, (char**)&ret.output));
+
+        case MPC_TYPE_UNDEFINED: MPC_VM_FAILURE(mpc_err_fail(i, "Parser Undefined!"));
+        case MPC_TYPE_PASS:      MPC_VM_SUCCESS(NULL);
+        case MPC_TYPE_FAIL:      MPC_VM_FAILURE(mpc_err_fail(i, c->data.fail.m));
+        case MPC_TYPE_LIFT:      MPC_VM_SUCCESS(c->data.lift.lf());
+        case MPC_TYPE_LIFT_VAL:  MPC_VM_SUCCESS(c->data.lift.x);
+        case MPC_TYPE_STATE:     MPC_VM_SUCCESS(mpc_input_state_copy(i));
+
+        case MPC_TYPE_APPLY:
+        case MPC_TYPE_APPLY_TO:
+        case MPC_TYPE_CHECK:
+        case MPC_TYPE_CHECK_WITH:
+          MPC_VM_CHAIN(MPC_VM_CHILD(0));
+
+        case MPC_TYPE_MAYBE:
+          MPC_VM_CALL(MPC_VM_CHILD(0));
+
+        case MPC_TYPE_EXPECT:
+          mpc_input_suppress_enable(i);
+          MPC_VM_CHAIN(MPC_VM_CHILD(0));
+
+        case MPC_TYPE_PREDICT:
+          mpc_input_backtrack_disable(i);
+          MPC_VM_CHAIN(MPC_VM_CHILD(0));
+
+        case MPC_TYPE_NOT:
+          mpc_input_mark(i);
+          mpc_input_suppress_enable(i);
+          MPC_VM_CALL(MPC_VM_CHILD(0));
+
+        case MPC_TYPE_MANY:
+        case MPC_TYPE_MANY1:
+          if (mpc_many_set(i, &c->data.repeat, 0)) {
+            ok = mpc_parse_many_set(i, &c->data.repeat, c->type == MPC_TYPE_MANY1, &ret, fe);
+            goto done;
+          }
+          f->slots = MPC_PARSE_STACK_MIN;
+          MPC_VM_CALL(MPC_VM_CHILD(0));
 
-      if (p->data.or.n == 0) { MPC_SUCCESS(NULL); }
+        case MPC_TYPE_COUNT:
+          if (c->data.repeat.n > MPC_PARSE_STACK_MIN) {
+            f->results = mpc_malloc(i, sizeof(mpc_result_t) * c->data.repeat.n);
+          }
+          MPC_VM_CALL(MPC_VM_CHILD(0));
+
+        case MPC_TYPE_OR:
+          if (c->n == 0) { MPC_VM_SUCCESS(NULL); }
+          f->j = mpc_or_next(i, &c->data.or, 0);
+          if (f->j == c->n) { MPC_VM_FAILURE(NULL); }
+          MPC_VM_CALL(MPC_VM_CHILD(f->j));
+
+        case MPC_TYPE_AND:
+          if (c->n == 0) { MPC_VM_SUCCESS(NULL); }
+          if (c->n > MPC_PARSE_STACK_MIN) {
+            f->results = mpc_malloc(i, sizeof(mpc_result_t) * c->n);
+          }
+          mpc_input_mark(i);
+          MPC_VM_CALL(MPC_VM_CHILD(0));
 
-      results = p->data.or.n > MPC_PARSE_STACK_MIN
-        ? mpc_malloc(i, sizeof(mpc_result_t) * p->data.or.n)
-        : results_stk;
+        case MPC_TYPE_DFA:
+          if (mpc_dfa_applies(i, c->data.dfa.d, 0)) {
+            ok = mpc_dfa_run(i, c->data.dfa.d, &ret, fe);
+            goto done;
+          }
+          /* continue as the combinators in this frame so depths stay the same */
+          f->pc = MPC_VM_CHILD(0);
+          f->resumed = 0;
+          continue;
 
-      for (j = 0; j < p->data.or.n; j++) {
-        if (mpc_parse_run(i, p->data.or.xs[j], &results[j], e, depth+1)) {
-          MPC_SUCCESS(results[j].output;
-            if (p->data.or.n > MPC_PARSE_STACK_MIN) { mpc_free(i, results); });
-        } else {
-          *e = mpc_err_merge(i, *e, results[j].error);
-        }
+        default:
+          MPC_VM_FAILURE(mpc_err_fail(i, "Unknown Parser Type Id!"));
       }
+    }
 
-      MPC_FAILURE(NULL;
-        if (p->data.or.n > MPC_PARSE_STACK_MIN) { mpc_free(i, results); });
+    /* resumed with the result of a child in `ok` and `ret` */
+    resume:
 
-    case MPC_TYPE_AND:
+    switch (c->type) {
 
-      if (p->data.and.n == 0) { MPC_SUCCESS(NULL); }
+      case MPC_TYPE_APPLY:
+        if (ok) { MPC_VM_SUCCESS(mpc_parse_apply(i, c->data.apply.f, ret.output)); }
+        MPC_VM_FAILURE(ret.error);
 
-      results = p->data.or.n > MPC_PARSE_STACK_MIN
-        ? mpc_malloc(i, sizeof(mpc_result_t) * p->data.or.n)
-        : results_stk;
+      case MPC_TYPE_APPLY_TO:
+        if (ok) { MPC_VM_SUCCESS(mpc_parse_apply_to(i, c->data.apply_to.f, ret.output, c->data.apply_to.d)); }
+        MPC_VM_FAILURE(ret.error);
 
-      mpc_input_mark(i);
-      for (j = 0; j < p->data.and.n; j++) {
-        if (!mpc_parse_run(i, p->data.and.xs[j], &results[j], e, depth+1)) {
+      case MPC_TYPE_CHECK:
+        if (!ok) { MPC_VM_FAILURE(ret.error); }
+        if (c->data.check.f(&ret.output)) { MPC_VM_SUCCESS(ret.output); }
+        mpc_parse_dtor(i, c->data.check.dx, ret.output);
+        MPC_VM_FAILURE(mpc_err_fail(i, c->data.check.e));
+
+      case MPC_TYPE_CHECK_WITH:
+        if (!ok) { MPC_VM_FAILURE(ret.error); }
+        if (c->data.check_with.f(&ret.output, c->data.check_with.d)) { MPC_VM_SUCCESS(ret.output); }
+        mpc_parse_dtor(i, c->data.check_with.dx, ret.output);
+        MPC_VM_FAILURE(mpc_err_fail(i, c->data.check_with.e));
+
+      case MPC_TYPE_EXPECT:
+        mpc_input_suppress_disable(i);
+        if (ok) { MPC_VM_SUCCESS(ret.output); }
+        MPC_VM_FAILURE(mpc_err_new(i, c->data.expect.m));
+
+      case MPC_TYPE_PREDICT:
+        mpc_input_backtrack_enable(i);
+        goto done;
+
+
+      case MPC_TYPE_NOT:
+        if (ok) {
           mpc_input_rewind(i);
-          for (k = 0; k < j; k++) {
-            mpc_parse_dtor(i, p->data.and.dxs[k], results[k].output);
-          }
-          MPC_FAILURE(results[j].error;
-            if (p->data.or.n > MPC_PARSE_STACK_MIN) { mpc_free(i, results); });
+          mpc_input_suppress_disable(i);
+          mpc_parse_dtor(i, c->data.not.dx, ret.output);
+          MPC_VM_FAILURE(mpc_err_new(i, "opposite"));
         }
-      }
-      mpc_input_unmark(i);
-      MPC_SUCCESS(
-        mpc_parse_fold(i, p->data.and.f, j, (mpc_val_t**)results);
-        if (p->data.or.n > MPC_PARSE_STACK_MIN) { mpc_free(i, results); });
-
-    /* End */
+        mpc_input_unmark(i);
+        mpc_input_suppress_disable(i);
+        MPC_VM_SUCCESS(c->data.not.lf());
+
+      case MPC_TYPE_MAYBE:
+        if (ok) { MPC_VM_SUCCESS(ret.output); }
+        *fe = mpc_err_merge(i, *fe, ret.error);
+        MPC_VM_SUCCESS(c->data.not.lf());
+
+      case MPC_TYPE_MANY:
+      case MPC_TYPE_MANY1:
+        if (ok) {
+          mpc_frame_results(f)[f->j++] = ret;
+          mpc_frame_grow(i, f);
+          MPC_VM_CALL(MPC_VM_CHILD(0));
+        }
+        if (c->type == MPC_TYPE_MANY1 && f->j == 0) {
+          MPC_VM_FAILURE(mpc_err_many1(i, ret.error));
+        }
+        *fe = mpc_err_merge(i, *fe, ret.error);
+        ret.output = mpc_parse_fold(i, c->data.repeat.f, f->j, (mpc_val_t**)mpc_frame_results(f));
+        mpc_frame_free(i, f);
+        ok = 1;
+        goto done;
+
+      case MPC_TYPE_COUNT:
+        if (ok) {
+          mpc_frame_results(f)[f->j++] = ret;
+          if (f->j < c->data.repeat.n) { MPC_VM_CALL(MPC_VM_CHILD(0)); }
+          ret.output = mpc_parse_fold(i, c->data.repeat.f, f->j, (mpc_val_t**)mpc_frame_results(f));
+          mpc_frame_free(i, f);
+          ok = 1;
+          goto done;
+        }
+        for (k = 0; k < f->j; k++) {
+          mpc_parse_dtor(i, c->data.repeat.dx, mpc_frame_results(f)[k].output);
+        }
+        mpc_frame_free(i, f);
+        MPC_VM_FAILURE(mpc_err_count(i, ret.error, c->data.repeat.n));
+
+      case MPC_TYPE_OR:
+        if (ok) { goto done; }
+        *fe = mpc_err_merge(i, *fe, ret.error);
+        f->j = mpc_or_next(i, &c->data.or, f->j + 1);
+        if (f->j < c->n) { MPC_VM_CALL(MPC_VM_CHILD(f->j)); }
+        MPC_VM_FAILURE(NULL);
+
+      case MPC_TYPE_AND:
+        if (ok) {
+          mpc_frame_results(f)[f->j++] = ret;
+          if (f->j < c->n) { MPC_VM_CALL(MPC_VM_CHILD(f->j)); }
+          mpc_input_unmark(i);
+          ret.output = mpc_parse_fold(i, c->data.and.f, f->j, (mpc_val_t**)mpc_frame_results(f));
+          mpc_frame_free(i, f);
+          ok = 1;
+          goto done;
+        }
+        mpc_input_rewind(i);
+        for (k = 0; k < f->j; k++) {
+          mpc_parse_dtor(i, c->data.and.dxs[k], mpc_frame_results(f)[k].output);
+        }
+        mpc_frame_free(i, f);
+        MPC_VM_FAILURE(ret.error);
 
-    default:
+      default:
+        goto done;
+    }
 
-      MPC_FAILURE(mpc_err_fail(i, "Unknown Parser Type Id!"));
+    /* the frame is finished with `ok` and `ret`, resume the node above in the chain or the parent */
+    done:
+    if (f->pc != f->top) {
+      for (k = f->top; MPC_VM_CHILD_OF(k) != f->pc; k = MPC_VM_CHILD_OF(k));
+      f->pc = k;
+      c = &prog->code[k];
+      goto resume;
+    }
+    if (f->memo) {
+      mpc_memo_store(i, c->parser, f->memo_pos, f->memo_flags, f->memo_seen, ok, &ret, f->inner);
+      if (f->inner) {
+        fe = f->peo < 0 ? e : &stk[f->peo].inner;
+        *fe = mpc_err_merge(i, *fe, f->inner);
+      }
+    }
+    num--;
   }
 
-  return 0;
+#undef MPC_VM_CALL
+#undef MPC_VM_CHAIN
+#undef MPC_VM_CHILD
+#undef MPC_VM_CHILD_OF
+#undef MPC_VM_SUCCESS
+#undef MPC_VM_FAILURE
+#undef MPC_VM_PRIMITIVE
 
+  free(stk);
+  *r = ret;
+  return ok;
 }
 
-#undef MPC_SUCCESS
-#undef MPC_FAILURE
-#undef MPC_PRIMITIVE
+/* back to the start of a string input, or a stream item, for another pass */
+static void mpc_input_restart(mpc_input_t *i) {
+  i->state = i->origin;
+  i->last = i->origin_last;
+  i->starved = 0;
+  i->suppress = 0;
+  i->backtrack = 1;
+  i->marks_num = 0;
+  mpc_memo_reset(i);
+  mpc_arena_reset(i);
+}
+
+static int mpc_parse_pass(mpc_input_t *i, mpc_parser_t *p, mpc_result_t *r, mpc_err_t **e) {
+  *e = mpc_err_fail(i, "Unknown Error");
+  if (*e) { (*e)->state = mpc_state_invalid(); }
+  i->prog = p->prog;
+  return mpc_parse_run(i, p, r, e, 0);
+}
+
+/*
+** String inputs are first parsed lazily, without
+** building any errors, so valid input never pays
+** for messages. Only when that pass fails is the
+** input parsed again to find the furthest error
+** and what was expected there. That pass runs
+** the apply and check callbacks of the grammar
+** again, as mpc.h says under "Parsing".
+*/
 
 int mpc_parse_input(mpc_input_t *i, mpc_parser_t *p, mpc_result_t *r) {
   int x;
-  mpc_err_t *e = mpc_err_fail(i, "Unknown Error");
-  e->state = mpc_state_invalid();
-  x = mpc_parse_run(i, p, r, &e, 0);
+  mpc_err_t *e;
+  if (p->ast) {
+    i->ast = mpc_store_new(i->slices && (p->ast & MPCA_LANG_AST_SLICES), p->ast & MPCA_LANG_AST_ARENA);
+  }
+  x = mpc_parse_pass(i, p, r, &e);
+  /* a stream that ran out of input is fed more before anything is reported */
+  if (!x && i->lazy && !(i->partial && i->starved)) {
+    mpc_input_restart(i);
+    i->lazy = 0;
+    x = mpc_parse_pass(i, p, r, &e);
+  }
   if (x) {
     mpc_err_delete_internal(i, e);
     r->output = mpc_export(i, r->output);
+  } else if (i->lazy) {
+    r->error = NULL;
   } else {
     r->error = mpc_err_export(i, mpc_err_merge(i, e, r->error));
   }
+  if (i->ast) {
+    /* the memo table holds nodes of the store */
+    mpc_memo_reset(i);
+    if (x && r->output) {
+      i->ast->root = r->output;
+      i->ast->dirty = !(i->ast->root->flags & MPC_AST_SHARED_NODE);
+      i->ast->root->store = i->ast;
+    } else {
+      mpc_store_delete(i->ast);
+    }
+    i->ast = NULL;
+  }
   return x;
 }
 
@@ -1334,9 +2920,54 @@ int mpc_nparse(const char *filename, const char *string, size_t length, mpc_pars
   return x;
 }
 
+#ifdef MPC_MMAP
+
+/*
+** Maps the rest of a regular file and parses it
+** as a string. Returns -1 without touching the
+** file when it can't be mapped.
+*/
+
+static int mpc_parse_mapped(const char *filename, FILE *file, mpc_parser_t *p, mpc_result_t *r) {
+
+  struct stat s;
+  long start = ftell(file);
+  char *m = NULL;
+  size_t size;
+  int x;
+  mpc_input_t *i;
+
+  if (start < 0 || fstat(fileno(file), &s) != 0
+  ||  !S_ISREG(s.st_mode) || s.st_size < start
+  ||  (size_t)s.st_size != (unsigned long)s.st_size) { return -1; }
+
+  size = (size_t)s.st_size;
+  if (size > (size_t)start) {
+    m = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fileno(file), 0);
+    if (m == MAP_FAILED) { return -1; }
+  }
+
+  i = mpc_input_new_nstring(filename, m ? m + start : "", size - start);
+  i->slices = 0;
+  x = mpc_parse_input(i, p, r);
+
+  /* leave the file where reading it would have */
+  fseek(file, start + i->state.pos, SEEK_SET);
+  mpc_input_delete(i);
+  if (m) { munmap(m, size); }
+  return x;
+}
+
+#endif
+
 int mpc_parse_file(const char *filename, FILE *file, mpc_parser_t *p, mpc_result_t *r) {
   int x;
-  mpc_input_t *i = mpc_input_new_file(filename, file);
+  mpc_input_t *i;
+#ifdef MPC_MMAP
+  x = mpc_parse_mapped(filename, file, p, r);
+  if (x >= 0) { return x; }
+#endif
+  i = mpc_input_new_file(filename, file);
   x = mpc_parse_input(i, p, r);
   mpc_input_delete(i);
   return x;
@@ -1366,6 +2997,249 @@ int mpc_parse_contents(const char *filename, mpc_parser_t *p, mpc_result_t *r) {
   return res;
 }
 
+/*
+** Parse Context
+*/
+
+struct mpc_context_t {
+  mpc_input_t *input;
+  size_t filename_slots;
+};
+
+mpc_context_t *mpc_context_new(void) {
+  mpc_context_t *c = malloc(sizeof(mpc_context_t));
+  c->input = mpc_input_new_nstring("", "", 0);
+  c->filename_slots = 1;
+  return c;
+}
+
+void mpc_context_delete(mpc_context_t *c) {
+  mpc_input_delete(c->input);
+  free(c);
+}
+
+static char *mpc_context_copy(char *x, size_t *slots, const char *s, size_t n) {
+  if (n + 1 > *slots) {
+    *slots = n + 1 > *slots * 2 ? n + 1 : *slots * 2;
+    x = realloc(x, *slots);
+  }
+  memcpy(x, s, n);
+  x[n] = '\0';
+  return x;
+}
+
+int mpc_context_nparse(mpc_context_t *c, const char *filename, const char *string, size_t length, mpc_parser_t *p, mpc_result_t *r) {
+  mpc_input_t *i = c->input;
+  i->filename = mpc_context_copy(i->filename, &c->filename_slots, filename, strlen(filename));
+  i->string = string;
+  i->length = length;
+  mpc_input_restart(i);
+  i->lazy = 1;
+  return mpc_parse_input(i, p, r);
+}
+
+int mpc_context_parse(mpc_context_t *c, const char *filename, const char *string, mpc_parser_t *p, mpc_result_t *r) {
+  return mpc_context_nparse(c, filename, string, strlen(string), p, r);
+}
+
+/*
+** Parse Stream
+**
+** The stream keeps what has been fed from the
+** start of the item being read to `end`. Each
+** item is parsed as a string starting at the
+** `origin` of the input, which carries the row
+** and column on from the items before it.
+**
+** Parsing an unfinished item again on every feed
+** is quadratic in its length, so the bracket
+** depth of the item is counted as it is fed. It
+** is only parsed again once a bracket or space
+** at depth zero or below shows it may be done,
+** or once it is twice as long as when it was
+** last parsed, which still finds errors inside
+** brackets in linear time overall.
+*/
+
+struct mpc_stream_t {
+  mpc_input_t *input;
+  mpc_parser_t *parser;
+  mpc_dtor_t dtor;
+  char *data;
+  size_t start;
+  size_t end;
+  size_t slots;
+  int fed;
+  int gated;
+  signed char depths[256];
+  long depth;
+  size_t scan;
+  size_t tried;
+};
+
+/* map the opening brackets of `brackets` to 1 and the closing ones to -1 */
+static void mpc_brackets_depths(signed char *depths, const char *brackets) {
+  int j;
+  memset(depths, 0, 256);
+  for (j = 0; brackets[j] && brackets[j+1]; j += 2) {
+    depths[(unsigned char)brackets[j]] = 1;
+    depths[(unsigned char)brackets[j+1]] = -1;
+  }
+}
+
+mpc_stream_t *mpc_stream_new(const char *filename, mpc_parser_t *p, const char *brackets, mpc_dtor_t da) {
+  mpc_stream_t *s = malloc(sizeof(mpc_stream_t));
+  s->input = mpc_input_new_nstring(filename, "", 0);
+  s->input->slices = 0;
+  s->input->partial = 1;
+  s->parser = p;
+  s->dtor = da;
+  s->data = NULL;
+  s->start = 0;
+  s->end = 0;
+  s->slots = 0;
+  s->fed = 0;
+  s->gated = brackets != NULL;
+  mpc_brackets_depths(s->depths, brackets ? brackets : "");
+  s->depth = 0;
+  s->scan = 0;
+  s->tried = 0;
+  return s;
+}
+
+void mpc_stream_delete(mpc_stream_t *s) {
+  mpc_input_delete(s->input);
+  free(s->data);
+  free(s);
+}
+
+void mpc_stream_feed(mpc_stream_t *s, const char *data, size_t length) {
+
+  /* drop the items already read before growing the buffer */
+  if (s->end + length > s->slots && s->start > 0) {
+    memmove(s->data, s->data + s->start, s->end - s->start);
+    s->end -= s->start;
+    s->start = 0;
+  }
+
+  if (s->end + length > s->slots) {
+    s->slots = s->end + length > s->slots * 2 ? s->end + length : s->slots * 2;
+    s->data = realloc(s->data, s->slots);
+  }
+
+  memcpy(s->data + s->end, data, length);
+  s->end += length;
+  s->fed = 1;
+}
+
+void mpc_stream_finish(mpc_stream_t *s) {
+  s->input->partial = 0;
+  s->fed = 1;
+}
+
+/* move the origin over `n` characters that are not part of any item */
+static void mpc_stream_skip(mpc_stream_t *s, size_t n) {
+  mpc_input_t *i = s->input;
+  s->depth = 0;
+  s->scan = 0;
+  s->tried = 0;
+  for (; n > 0; n--) {
+    i->origin_last = s->data[s->start++];
+    i->origin.col++;
+    if (i->origin_last == '\n') {
+      i->origin.col = 0;
+      i->origin.row++;
+    }
+  }
+}
+
+static int mpc_stream_space(char c) {
+  return c != '\0' && strchr(" \f\n\r\t\v", c) != NULL;
+}
+
+/*
+** Count the depth over the part of the item not
+** counted yet, 1 if it may be done. The count
+** stops there and goes on when the item turns
+** out to need more input.
+*/
+
+static int mpc_stream_ready(mpc_stream_t *s) {
+  int ready = !s->gated || s->tried == 0 || s->end - s->start >= s->tried * 2;
+  int d;
+  char c;
+  while (!ready && s->start + s->scan < s->end) {
+    c = s->data[s->start + s->scan++];
+    d = s->depths[(unsigned char)c];
+    s->depth += d;
+    ready = s->depth <= 0 && (d != 0 || mpc_stream_space(c));
+  }
+  return ready;
+}
+
+int mpc_stream_next(mpc_stream_t *s, mpc_result_t *r) {
+
+  mpc_input_t *i = s->input;
+  int x;
+
+  r->error = NULL;
+
+  while (s->start < s->end && mpc_stream_space(s->data[s->start])) {
+    mpc_stream_skip(s, 1);
+  }
+
+  /* nothing fed since the last item ran out of input */
+  if (s->start == s->end || !s->fed) { return 0; }
+
+  /* nothing fed that could finish it */
+  if (!mpc_stream_ready(s) && i->partial) {
+    s->fed = 0;
+    return 0;
+  }
+
+  i->string = s->data + s->start;
+  i->length = (long)(s->end - s->start);
+  mpc_input_restart(i);
+  i->lazy = 1;
+  x = mpc_parse_input(i, s->parser, r);
+
+  /*
+  ** An item that ran out of input is parsed again
+  ** once more is fed, unless what has been fed ends
+  ** in whitespace, which can't continue it.
+  */
+
+  if (x && i->partial && i->starved && !mpc_stream_space(s->data[s->end-1])) {
+    s->dtor(r->output);
+    r->error = NULL;
+    s->fed = 0;
+    s->tried = s->end - s->start;
+    return 0;
+  }
+
+  if (!x && i->lazy) {
+    s->fed = 0;
+    s->tried = s->end - s->start;
+    return 0;
+  }
+
+  /* after an error everything fed so far is dropped */
+  if (!x) {
+    mpc_stream_skip(s, s->end - s->start);
+    return 0;
+  }
+
+  s->start += i->state.pos;
+  s->depth = 0;
+  s->scan = 0;
+  s->tried = 0;
+  i->origin = i->state;
+  i->origin.pos = 0;
+  i->origin.term = 0;
+  i->origin_last = i->last;
+  return 1;
+}
+
 /*
 ** Building a Parser
 */
@@ -1379,6 +3253,7 @@ static void mpc_undefine_or(mpc_parser_t *p) {
     mpc_undefine_unretained(p->data.or.xs[i], 0);
   }
   free(p->data.or.xs);
+  free(p->data.or.jump);
 
 }
 
@@ -1397,6 +3272,9 @@ static void mpc_undefine_unretained(mpc_parser_t *p, int force) {
 
   if (p->retained && !force) { return; }
 
+  mpc_prog_delete(p->prog);
+  p->prog = NULL;
+
   switch (p->type) {
 
     case MPC_TYPE_FAIL: free(p->data.fail.m); break;
@@ -1440,6 +3318,11 @@ static void mpc_undefine_unretained(mpc_parser_t *p, int force) {
       free(p->data.check_with.e);
       break;
 
+    case MPC_TYPE_DFA:
+      mpc_undefine_unretained(p->data.dfa.x, 0);
+      mpc_dfa_delete(p->data.dfa.d);
+      break;
+
     default: break;
   }
 
@@ -1457,6 +3340,7 @@ void mpc_delete(mpc_parser_t *p) {
       mpc_undefine_unretained(p, 0);
     }
 
+    mpc_prog_delete(p->prog);
     free(p->name);
     free(p);
 
@@ -1474,6 +3358,7 @@ static mpc_parser_t *mpc_undefined(void) {
   p->retained = 0;
   p->type = MPC_TYPE_UNDEFINED;
   p->name = NULL;
+  p->id = -1;
   return p;
 }
 
@@ -1537,6 +3422,7 @@ mpc_parser_t *mpc_copy(mpc_parser_t *a) {
       break;
 
     case MPC_TYPE_OR:
+      p->data.or.jump = NULL;
       p->data.or.xs = malloc(a->data.or.n * sizeof(mpc_parser_t*));
       for (i = 0; i < a->data.or.n; i++) {
         p->data.or.xs[i] = mpc_copy(a->data.or.xs[i]);
@@ -1564,6 +3450,11 @@ mpc_parser_t *mpc_copy(mpc_parser_t *a) {
       strcpy(p->data.check_with.e, a->data.check_with.e);
       break;
 
+    case MPC_TYPE_DFA:
+      p->data.dfa.x = mpc_copy(a->data.dfa.x);
+      p->data.dfa.d = mpc_dfa_copy(a->data.dfa.d);
+      break;
+
     default: break;
   }
 
@@ -1764,6 +3655,7 @@ mpc_parser_t *mpc_oneof(const char *s) {
   p->type = MPC_TYPE_ONEOF;
   p->data.string.x = malloc(strlen(s) + 1);
   strcpy(p->data.string.x, s);
+  mpc_set_init(p->data.string.set, s, 0);
   return mpc_expectf(p, "one of '%s'", s);
 }
 
@@ -1772,6 +3664,7 @@ mpc_parser_t *mpc_noneof(const char *s) {
   p->type = MPC_TYPE_NONEOF;
   p->data.string.x = malloc(strlen(s) + 1);
   strcpy(p->data.string.x, s);
+  mpc_set_init(p->data.string.set, s, 1);
   return mpc_expectf(p, "none of '%s'", s);
 
 }
@@ -2287,19 +4180,20 @@ static const char *mpc_re_range_escape_char(char c) {
   }
 }
 
-static mpc_val_t *mpcf_re_range(mpc_val_t *x) {
+/* characters of a range expression, NULL if it is invalid */
+static char *mpc_re_range_chars(const char *s) {
 
-  mpc_parser_t *out;
   size_t i, j;
   size_t start, end;
   const char *tmp = NULL;
-  const char *s = x;
   int comp = s[0] == '^' ? 1 : 0;
-  char *range = calloc(1,1);
+  char *range;
 
-  if (s[0] == '\0') { free(range); free(x); return mpc_fail("Invalid Regex Range Expression"); }
+  if (s[0] == '\0') { return NULL; }
   if (s[0] == '^' &&
-      s[1] == '\0') { free(range); free(x); return mpc_fail("Invalid Regex Range Expression"); }
+      s[1] == '\0') { return NULL; }
+
+  range = calloc(1,1);
 
   for (i = comp; i < strlen(s); i++){
 
@@ -2333,21 +4227,202 @@ static mpc_val_t *mpcf_re_range(mpc_val_t *x) {
       }
     }
 
-    /* Regex Range Normal */
+    /* Regex Range Normal */
+    else {
+      range = realloc(range, strlen(range) + 1 + 1);
+      range[strlen(range) + 1] = '\0';
+      range[strlen(range) + 0] = s[i];
+    }
+
+  }
+
+  return range;
+}
+
+static mpc_val_t *mpcf_re_range(mpc_val_t *x) {
+
+  mpc_parser_t *out;
+  const char *s = x;
+  char *range = mpc_re_range_chars(s);
+
+  if (range == NULL) { free(x); return mpc_fail("Invalid Regex Range Expression"); }
+
+  out = s[0] == '^' ? mpc_noneof(range) : mpc_oneof(range);
+
+  free(x);
+  free(range);
+
+  return out;
+}
+
+/*
+** Builds the automaton for a regex made of
+** single characters, escapes, `.` and ranges,
+** each optionally followed by `*`, `+`, `?` or
+** a count. Anything else, including groups,
+** alternation and anchors, returns NULL and is
+** only matched by the combinators.
+*/
+
+enum {
+  MPC_DFA_COUNT_MAX = 256,
+  MPC_DFA_RANGE_MAX = 1024
+};
+
+static struct mpc_dfa_t *mpc_re_dfa(const char *re, int mode) {
+
+  int j, k, n, items = 0;
+  char quant, single[2];
+  char *chars = NULL, *expected = NULL;
+  const char *s = re, *t;
+  unsigned char set[32];
+  mpc_dfa_state_t *q;
+  struct mpc_dfa_t *d = calloc(1, sizeof(struct mpc_dfa_t));
+
+  while (*s) {
+
+    /* Base */
+
+    single[1] = '\0';
+
+    if (*s == '(' || *s == ')' || *s == '|' || *s == '^' || *s == '$') { goto unsupported; }
+
+    if (*s == '[') {
+      for (t = s + 1; *t && *t != ']'; t++) {
+        if (*t == '\\') {
+          if (t[1] == '\0') { goto unsupported; }
+          t++;
+        }
+      }
+      if (*t == '\0') { goto unsupported; }
+      expected = malloc(t - s);
+      memcpy(expected, s + 1, t - s - 1);
+      expected[t - s - 1] = '\0';
+      chars = mpc_re_range_chars(expected);
+      if (chars == NULL || strlen(chars) > MPC_DFA_RANGE_MAX) { goto unsupported; }
+      mpc_set_init(set, chars, expected[0] == '^');
+      free(expected);
+      expected = malloc(strlen(chars) + strlen("none of ''") + 1);
+      sprintf(expected, s[1] == '^' ? "none of '%s'" : "one of '%s'", chars);
+      free(chars);
+      chars = NULL;
+      s = t + 1;
+    }
+
+    else if (*s == '\\') {
+      switch (s[1]) {
+        case '\0': case 'b': case 'B': case 'A': case 'Z': case 'D': case 'S': case 'W':
+          goto unsupported;
+        case 'd': mpc_set_init(set, "0123456789", 0); expected = "digit"; break;
+        case 's': mpc_set_init(set, " \f\n\r\t\v", 0); expected = "whitespace"; break;
+        case 'w':
+          mpc_set_init(set, "abcdefghijklmnopqrstuvwxyzABCDEFGHIJKLMNOPQRSTUVWXYZ0123456789_", 0);
+          expected = "alphanumeric";
+          break;
+        case 'a': single[0] = '\a'; break;
+        case 'f': single[0] = '\f'; break;
+        case 'n': single[0] = '\n'; break;
+        case 'r': single[0] = '\r'; break;
+        case 't': single[0] = '\t'; break;
+        case 'v': single[0] = '\v'; break;
+        default:  single[0] = s[1]; break;
+      }
+      if (expected) {
+        t = expected;
+        expected = malloc(strlen(t) + 1);
+        strcpy(expected, t);
+      }
+      s += 2;
+    }
+
+    else if (*s == '.') {
+      mpc_set_init(set, (mode & MPC_RE_DOTALL) ? "" : "\n", 1);
+      t = (mode & MPC_RE_DOTALL) ? "any character" : "any character except a newline";
+      expected = malloc(strlen(t) + 1);
+      strcpy(expected, t);
+      s++;
+    }
+
     else {
-      range = realloc(range, strlen(range) + 1 + 1);
-      range[strlen(range) + 1] = '\0';
-      range[strlen(range) + 0] = s[i];
+      single[0] = *s;
+      s++;
     }
 
+    if (expected == NULL) {
+      mpc_set_init(set, single, 0);
+      expected = malloc(4);
+      sprintf(expected, "'%c'", single[0]);
+    }
+
+    /* Repetition */
+
+    quant = *s;
+    n = 1;
+
+    if (quant == '*' || quant == '+' || quant == '?') {
+      s++;
+    } else if (quant == '{') {
+      for (t = s + 1; *t >= '0' && *t <= '9'; t++);
+      if (t == s + 1 || *t != '}' || t - s > 4) { goto unsupported; }
+      n = atoi(s + 1);
+      if (n == 0 || n > MPC_DFA_COUNT_MAX) { goto unsupported; }
+      s = t + 1;
+    }
+
+    k = d->states_num;
+    d->states_num += quant == '{' ? n : quant == '+' ? 2 : 1;
+    d->states = realloc(d->states, sizeof(mpc_dfa_state_t) * d->states_num);
+
+    for (j = k; j < d->states_num; j++) {
+      q = &d->states[j];
+      memcpy(q->set, set, 32);
+      q->match = j + 1;
+      q->skip = d->states_num;
+      q->fail = MPC_DFA_FAIL;
+      q->n = n;
+      q->expected = malloc(strlen(expected) + 1);
+      strcpy(q->expected, expected);
+    }
+
+    switch (quant) {
+      case '*': d->states[k].match = k; d->states[k].fail = MPC_DFA_SKIP; break;
+      case '?': d->states[k].fail = MPC_DFA_SKIP; break;
+      case '+':
+        d->states[k].fail = MPC_DFA_MANY1;
+        d->states[k+1].match = k+1;
+        d->states[k+1].fail = MPC_DFA_SKIP;
+        break;
+      case '{': for (j = k; j < d->states_num; j++) { d->states[j].fail = MPC_DFA_COUNT; } break;
+      default: break;
+    }
+
+    free(expected);
+    expected = NULL;
+    items++;
   }
 
-  out = comp == 1 ? mpc_noneof(range) : mpc_oneof(range);
+  /* a single item is not wrapped in a sequence that rewinds on failure */
+  d->rewind = items > 1;
+  return d;
 
-  free(x);
-  free(range);
+  unsupported:
+  free(chars);
+  free(expected);
+  for (j = 0; j < d->states_num; j++) { free(d->states[j].expected); }
+  free(d->states);
+  free(d);
+  return NULL;
+}
 
-  return out;
+/* levels of recursion the combinators of a regex reach */
+static int mpc_re_height(mpc_parser_t *p) {
+  mpc_parser_t **xs;
+  int j, h, height = 0, n = mpc_compile_children(p, &xs);
+  for (j = 0; j < n; j++) {
+    h = mpc_re_height(xs[j]);
+    height = h > height ? h : height;
+  }
+  return 1 + height;
 }
 
 mpc_parser_t *mpc_re(const char *re) {
@@ -2357,9 +4432,10 @@ mpc_parser_t *mpc_re(const char *re) {
 mpc_parser_t *mpc_re_mode(const char *re, int mode) {
 
   char *err_msg;
-  mpc_parser_t *err_out;
+  mpc_parser_t *err_out, *p;
   mpc_result_t r;
   mpc_parser_t *Regex, *Term, *Factor, *Base, *Range, *RegexEnclose;
+  struct mpc_dfa_t *dfa = mpc_re_dfa(re, mode);
 
   Regex  = mpc_new("regex");
   Term   = mpc_new("term");
@@ -2411,13 +4487,22 @@ mpc_parser_t *mpc_re_mode(const char *re, int mode) {
     mpc_err_delete(r.error);
     free(err_msg);
     r.output = err_out;
+    if (dfa) { mpc_dfa_delete(dfa); dfa = NULL; }
   }
 
   mpc_cleanup(6, RegexEnclose, Regex, Term, Factor, Base, Range);
 
   mpc_optimise(r.output);
 
-  return r.output;
+  if (dfa == NULL) { return r.output; }
+
+  dfa->height = mpc_re_height(r.output);
+
+  p = mpc_undefined();
+  p->type = MPC_TYPE_DFA;
+  p->data.dfa.x = r.output;
+  p->data.dfa.d = dfa;
+  return p;
 
 }
 
@@ -2648,19 +4733,25 @@ mpc_val_t *mpcf_freefold(int n, mpc_val_t **xs) {
 
 mpc_val_t *mpcf_strfold(int n, mpc_val_t **xs) {
   int i;
-  size_t l = 0;
+  size_t l = 0, k;
+  char *s;
 
   if (n == 0) { return calloc(1, 1); }
 
   for (i = 0; i < n; i++) { l += strlen(xs[i]); }
 
-  xs[0] = realloc(xs[0], l + 1);
+  s = realloc(xs[0], l + 1);
 
+  /* append at the known end instead of rescanning with strcat */
+  l = strlen(s);
   for (i = 1; i < n; i++) {
-    strcat(xs[0], xs[i]); free(xs[i]);
+    k = strlen(xs[i]);
+    memcpy(s + l, xs[i], k + 1);
+    l += k;
+    free(xs[i]);
   }
 
-  return xs[0];
+  return s;
 }
 
 mpc_val_t *mpcf_maths(int n, mpc_val_t **xs) {
@@ -2770,6 +4861,7 @@ static void mpc_print_unretained(mpc_parser_t *p, int force) {
   if (p->type == MPC_TYPE_APPLY)    { mpc_print_unretained(p->data.apply.x, 0); }
   if (p->type == MPC_TYPE_APPLY_TO) { mpc_print_unretained(p->data.apply_to.x, 0); }
   if (p->type == MPC_TYPE_PREDICT)  { mpc_print_unretained(p->data.predict.x, 0); }
+  if (p->type == MPC_TYPE_DFA)      { mpc_print_unretained(p->data.dfa.x, 0); }
 
   if (p->type == MPC_TYPE_NOT)   { mpc_print_unretained(p->data.not.x, 0); printf("!"); }
   if (p->type == MPC_TYPE_MAYBE) { mpc_print_unretained(p->data.not.x, 0); printf("?"); }
@@ -2884,28 +4976,123 @@ int mpc_test_pass(mpc_parser_t *p, const char *s, const void *d,
 ** AST
 */
 
+static void mpc_ast_iter_push(mpc_ast_iter_t *it, mpc_ast_t *a);
+
+/*
+** Copy of a node whose children are still those
+** of `a`. A node of an arena is copied into the
+** same store, strings `a` doesn't own stay
+** shared and those it owns are copied.
+*/
+
+static mpc_ast_t *mpc_ast_copy_node(mpc_ast_t *a) {
+
+  mpc_ast_t *b;
+  int stored = a->flags & MPC_AST_SHARED_NODE;
+
+  b = stored ? mpc_store_alloc_aligned(a->store, sizeof(mpc_ast_t)) : malloc(sizeof(mpc_ast_t));
+  *b = *a;
+  b->refs = 0;
+  if (!stored) { b->store = NULL; }
+  if (!(a->flags & MPC_AST_SHARED_TAG)) {
+    b->tag = malloc(strlen(a->tag) + 1);
+    strcpy(b->tag, a->tag);
+  }
+  if (!(a->flags & MPC_AST_SHARED_CONTENTS)) {
+    b->contents = malloc(a->length + 1);
+    memcpy(b->contents, a->contents, a->length + 1);
+  }
+  b->children = NULL;
+  if (a->children_num > 0) {
+    b->children = (a->flags & MPC_AST_SHARED_CHILDREN)
+      ? mpc_store_alloc_aligned(a->store, sizeof(mpc_ast_t*) * a->children_num)
+      : malloc(sizeof(mpc_ast_t*) * a->children_num);
+    memcpy(b->children, a->children, sizeof(mpc_ast_t*) * a->children_num);
+  }
+
+  return b;
+}
+
+/* another reference to `a` for the memo table, see `refs` */
+static mpc_ast_t *mpc_ast_share(mpc_ast_t *a) {
+  if (a) { a->refs++; }
+  return a;
+}
+
+/* `a` itself, or a copy to change when it is shared, holding its children */
+static mpc_ast_t *mpc_ast_unshare(mpc_ast_t *a) {
+
+  int j;
+  mpc_ast_t *b;
+
+  if (a == NULL || a->refs == 0) { return a; }
+
+  b = mpc_ast_copy_node(a);
+  for (j = 0; j < b->children_num; j++) {
+    if (b->children[j]) { b->children[j]->refs++; }
+  }
+  a->refs--;
+  return b;
+}
+
+/*
+** Deletes children before their parent with the
+** stack of an iterator, so any depth fits. The
+** root of a clean store releases its whole
+** subtree with the store and isn't entered, a
+** shared node only loses a reference.
+*/
+
 void mpc_ast_delete(mpc_ast_t *a) {
 
-  int i;
+  mpc_ast_iter_t it;
+  mpc_ast_iter_frame_t *f;
+  mpc_ast_store_t *s;
 
   if (a == NULL) { return; }
 
-  for (i = 0; i < a->children_num; i++) {
-    mpc_ast_delete(a->children[i]);
+  mpc_ast_iter_init(&it, a, mpc_ast_trav_order_post);
+
+  while (it.num > 0) {
+
+    f = &it.stack[it.num-1];
+    a = f->node;
+    s = a->store && a->store->root == a ? a->store : NULL;
+
+    if (f->child == -1) {
+      if (a->refs > 0) {
+        a->refs--;
+        it.num--;
+        continue;
+      }
+      if (s && s->nodes && !s->dirty) {
+        mpc_store_delete(s);
+        it.num--;
+        continue;
+      }
+      f->child = 0;
+    }
+
+    if (f->child < a->children_num) {
+      a = a->children[f->child++];
+      if (a) { mpc_ast_iter_push(&it, a); }
+      continue;
+    }
+
+    it.num--;
+    mpc_ast_delete_no_children(a);
+    if (s) { mpc_store_delete(s); }
   }
 
-  free(a->children);
-  free(a->tag);
-  free(a->contents);
-  free(a);
+  mpc_ast_iter_free(&it);
 
 }
 
 static void mpc_ast_delete_no_children(mpc_ast_t *a) {
-  free(a->children);
-  free(a->tag);
-  free(a->contents);
-  free(a);
+  if (!(a->flags & MPC_AST_SHARED_CHILDREN)) { free(a->children); }
+  if (!(a->flags & MPC_AST_SHARED_TAG)) { free(a->tag); }
+  if (!(a->flags & MPC_AST_SHARED_CONTENTS)) { free(a->contents); }
+  if (!(a->flags & MPC_AST_SHARED_NODE)) { free(a); }
 }
 
 mpc_ast_t *mpc_ast_new(const char *tag, const char *contents) {
@@ -2915,8 +5102,15 @@ mpc_ast_t *mpc_ast_new(const char *tag, const char *contents) {
   a->tag = malloc(strlen(tag) + 1);
   strcpy(a->tag, tag);
 
-  a->contents = malloc(strlen(contents) + 1);
-  strcpy(a->contents, contents);
+  a->length = strlen(contents);
+  a->contents = malloc(a->length + 1);
+  memcpy(a->contents, contents, a->length + 1);
+
+  a->flags = 0;
+  a->refs = 0;
+  a->store = NULL;
+  a->rule = -1;
+  a->rules = 0;
 
   a->state = mpc_state_new();
 
@@ -2962,7 +5156,8 @@ int mpc_ast_eq(mpc_ast_t *a, mpc_ast_t *b) {
   int i;
 
   if (strcmp(a->tag, b->tag) != 0) { return 0; }
-  if (strcmp(a->contents, b->contents) != 0) { return 0; }
+  if (a->length != b->length) { return 0; }
+  if (memcmp(a->contents, b->contents, a->length) != 0) { return 0; }
   if (a->children_num != b->children_num) { return 0; }
 
   for (i = 0; i < a->children_num; i++) {
@@ -2973,14 +5168,37 @@ int mpc_ast_eq(mpc_ast_t *a, mpc_ast_t *b) {
 }
 
 mpc_ast_t *mpc_ast_add_child(mpc_ast_t *r, mpc_ast_t *a) {
+  mpc_ast_t **cs;
+  r = mpc_ast_unshare(r);
+  if (r->store) { r->store->dirty = 1; }
+  /* children in a store can't grow, they are moved to the heap first */
+  if (r->flags & MPC_AST_SHARED_CHILDREN) {
+    cs = malloc(sizeof(mpc_ast_t*) * (r->children_num + 1));
+    memcpy(cs, r->children, sizeof(mpc_ast_t*) * r->children_num);
+    r->children = cs;
+    r->flags &= ~MPC_AST_SHARED_CHILDREN;
+  }
   r->children_num++;
   r->children = realloc(r->children, sizeof(mpc_ast_t*) * r->children_num);
   r->children[r->children_num-1] = a;
   return r;
 }
 
+/* a shared tag is copied before it is changed */
+static void mpc_ast_own_tag(mpc_ast_t *a) {
+  char *t;
+  if (!(a->flags & MPC_AST_SHARED_TAG)) { return; }
+  if (a->store) { a->store->dirty = 1; }
+  t = malloc(strlen(a->tag) + 1);
+  strcpy(t, a->tag);
+  a->tag = t;
+  a->flags &= ~MPC_AST_SHARED_TAG;
+}
+
 mpc_ast_t *mpc_ast_add_tag(mpc_ast_t *a, const char *t) {
   if (a == NULL) { return a; }
+  a = mpc_ast_unshare(a);
+  mpc_ast_own_tag(a);
   a->tag = realloc(a->tag, strlen(t) + 1 + strlen(a->tag) + 1);
   memmove(a->tag + strlen(t) + 1, a->tag, strlen(a->tag)+1);
   memmove(a->tag, t, strlen(t));
@@ -2988,8 +5206,17 @@ mpc_ast_t *mpc_ast_add_tag(mpc_ast_t *a, const char *t) {
   return a;
 }
 
+mpc_ast_t *mpc_ast_add_rule(mpc_ast_t *a, mpc_parser_t *rule) {
+  if (a == NULL) { return a; }
+  a = mpc_ast_add_tag(a, rule->name);
+  mpc_ast_rule_set(a, rule->id);
+  return a;
+}
+
 mpc_ast_t *mpc_ast_add_root_tag(mpc_ast_t *a, const char *t) {
   if (a == NULL) { return a; }
+  a = mpc_ast_unshare(a);
+  mpc_ast_own_tag(a);
   a->tag = realloc(a->tag, (strlen(t)-1) + strlen(a->tag) + 1);
   memmove(a->tag + (strlen(t)-1), a->tag, strlen(a->tag)+1);
   memmove(a->tag, t, (strlen(t)-1));
@@ -2997,6 +5224,8 @@ mpc_ast_t *mpc_ast_add_root_tag(mpc_ast_t *a, const char *t) {
 }
 
 mpc_ast_t *mpc_ast_tag(mpc_ast_t *a, const char *t) {
+  a = mpc_ast_unshare(a);
+  mpc_ast_own_tag(a);
   a->tag = realloc(a->tag, strlen(t) + 1);
   strcpy(a->tag, t);
   return a;
@@ -3004,10 +5233,19 @@ mpc_ast_t *mpc_ast_tag(mpc_ast_t *a, const char *t) {
 
 mpc_ast_t *mpc_ast_state(mpc_ast_t *a, mpc_state_t s) {
   if (a == NULL) { return a; }
+  a = mpc_ast_unshare(a);
   a->state = s;
   return a;
 }
 
+long mpc_ast_contents_len(mpc_ast_t *a) {
+  return a->length;
+}
+
+int mpc_ast_contents_eq(mpc_ast_t *a, const char *s) {
+  return (long)strlen(s) == a->length && memcmp(a->contents, s, a->length) == 0;
+}
+
 static void mpc_ast_print_depth(mpc_ast_t *a, int d, FILE *fp) {
 
   int i;
@@ -3019,11 +5257,11 @@ static void mpc_ast_print_depth(mpc_ast_t *a, int d, FILE *fp) {
 
   for (i = 0; i < d; i++) { fprintf(fp, "  "); }
 
-  if (strlen(a->contents)) {
-    fprintf(fp, "%s:%lu:%lu '%s'\n", a->tag,
+  if (a->length) {
+    fprintf(fp, "%s:%lu:%lu '%.*s'\n", a->tag,
       (long unsigned int)(a->state.row+1),
       (long unsigned int)(a->state.col+1),
-      a->contents);
+      (int)a->length, a->contents);
   } else {
     fprintf(fp, "%s \n", a->tag);
   }
@@ -3210,9 +5448,110 @@ void mpc_ast_traverse_free(mpc_ast_trav_t **trav) {
   }
 }
 
+/*
+** Every node gets a frame on the stack whose
+** `child` is -1 until the node has been entered.
+** Pre order returns a node when entering it, post
+** order when popping it after its last child.
+*/
+
+static void mpc_ast_iter_push(mpc_ast_iter_t *it, mpc_ast_t *a) {
+  if (it->num == it->slots) {
+    it->slots *= 2;
+    if (it->stack == it->local) {
+      it->stack = malloc(sizeof(mpc_ast_iter_frame_t) * it->slots);
+      memcpy(it->stack, it->local, sizeof(mpc_ast_iter_frame_t) * it->num);
+    } else {
+      it->stack = realloc(it->stack, sizeof(mpc_ast_iter_frame_t) * it->slots);
+    }
+  }
+  it->stack[it->num].node = a;
+  it->stack[it->num].child = -1;
+  it->num++;
+}
+
+void mpc_ast_iter_init(mpc_ast_iter_t *it, mpc_ast_t *ast, mpc_ast_trav_order_t order) {
+  it->stack = it->local;
+  it->slots = MPC_AST_ITER_LOCAL;
+  mpc_ast_iter_reset(it, ast, order);
+}
+
+void mpc_ast_iter_reset(mpc_ast_iter_t *it, mpc_ast_t *ast, mpc_ast_trav_order_t order) {
+  it->order = order;
+  it->num = 0;
+  if (ast != NULL) { mpc_ast_iter_push(it, ast); }
+}
+
+mpc_ast_t *mpc_ast_iter_next(mpc_ast_iter_t *it) {
+
+  mpc_ast_iter_frame_t *f;
+  mpc_ast_t *a;
+
+  while (it->num > 0) {
+
+    f = &it->stack[it->num-1];
+    a = f->node;
+
+    if (f->child == -1) {
+      f->child = 0;
+      if (it->order == mpc_ast_trav_order_pre) { return a; }
+    }
+
+    if (f->child < a->children_num) {
+      mpc_ast_iter_push(it, a->children[f->child++]);
+      continue;
+    }
+
+    it->num--;
+    if (it->order == mpc_ast_trav_order_post) { return a; }
+  }
+
+  return NULL;
+}
+
+void mpc_ast_iter_free(mpc_ast_iter_t *it) {
+  if (it->stack != it->local) { free(it->stack); }
+  it->stack = it->local;
+  it->slots = MPC_AST_ITER_LOCAL;
+  it->num = 0;
+}
+
+/*
+** Replaces `a` by its only child, adding the tag
+** of `a` in front of the child's. The new tag is
+** built in the buffer of the old one, which `a`
+** then gives to the child instead of freeing.
+*/
+
+static mpc_ast_t *mpc_ast_fold_root(mpc_ast_t *a) {
+
+  mpc_ast_t *c;
+  size_t n, m;
+
+  a = mpc_ast_unshare(a);
+  c = mpc_ast_unshare(a->children[0]);
+  mpc_ast_rule_lift(c, a);
+
+  if ((a->flags | c->flags) & MPC_AST_SHARED_TAG) {
+    c = mpc_ast_add_root_tag(c, a->tag);
+    mpc_ast_delete_no_children(a);
+    return c;
+  }
+
+  n = strlen(a->tag) - 1;
+  m = strlen(c->tag);
+  a->tag = realloc(a->tag, n + m + 1);
+  memcpy(a->tag + n, c->tag, m + 1);
+  free(c->tag);
+  c->tag = a->tag;
+  a->flags |= MPC_AST_SHARED_TAG;
+  mpc_ast_delete_no_children(a);
+  return c;
+}
+
 mpc_val_t *mpcf_fold_ast(int n, mpc_val_t **xs) {
 
-  int i, j;
+  int i, j, m = 0;
   mpc_ast_t** as = (mpc_ast_t**)xs;
   mpc_ast_t *r;
 
@@ -3223,18 +5562,24 @@ mpc_val_t *mpcf_fold_ast(int n, mpc_val_t **xs) {
 
   r = mpc_ast_new(">", "");
 
+  /* the children are counted first so their array is allocated once */
+  for (i = 0; i < n; i++) {
+    if (as[i] != NULL) { m += as[i]->children_num >= 2 ? as[i]->children_num : 1; }
+  }
+  if (m > 0) { r->children = malloc(sizeof(mpc_ast_t*) * m); }
+
   for (i = 0; i < n; i++) {
 
     if (as[i] == NULL) { continue; }
 
-    if        (as[i] && as[i]->children_num == 0) {
-      mpc_ast_add_child(r, as[i]);
-    } else if (as[i] && as[i]->children_num == 1) {
-      mpc_ast_add_child(r, mpc_ast_add_root_tag(as[i]->children[0], as[i]->tag));
-      mpc_ast_delete_no_children(as[i]);
-    } else if (as[i] && as[i]->children_num >= 2) {
+    if        (as[i]->children_num == 0) {
+      r->children[r->children_num++] = as[i];
+    } else if (as[i]->children_num == 1) {
+      r->children[r->children_num++] = mpc_ast_fold_root(as[i]);
+    } else {
+      as[i] = mpc_ast_unshare(as[i]);
       for (j = 0; j < as[i]->children_num; j++) {
-        mpc_ast_add_child(r, as[i]->children[j]);
+        r->children[r->children_num++] = as[i]->children[j];
       }
       mpc_ast_delete_no_children(as[i]);
     }
@@ -3275,6 +5620,10 @@ mpc_parser_t *mpca_add_tag(mpc_parser_t *a, const char *t) {
   return mpc_apply_to(a, (mpc_apply_to_t)mpc_ast_add_tag, (void*)t);
 }
 
+mpc_parser_t *mpca_rule_tag(mpc_parser_t *a, mpc_parser_t *rule) {
+  return mpc_apply_to(a, (mpc_apply_to_t)mpc_ast_add_rule, rule);
+}
+
 mpc_parser_t *mpca_root(mpc_parser_t *a) {
   return mpc_apply(a, (mpc_apply_t)mpc_ast_add_root);
 }
@@ -3513,7 +5862,7 @@ static mpc_val_t *mpcaf_grammar_id(mpc_val_t *x, void *s) {
   free(x);
 
   if (p->name) {
-    return mpca_state(mpca_root(mpca_add_tag(p, p->name)));
+    return mpca_state(mpca_root(mpca_rule_tag(p, p)));
   } else {
     return mpca_state(mpca_root(p));
   }
@@ -3656,14 +6005,20 @@ static mpc_val_t *mpca_stmt_list_apply_to(mpc_val_t *x, void *s) {
   mpca_stmt_t *stmt;
   mpca_stmt_t **stmts = x;
   mpc_parser_t *left;
+  int j;
 
   while(*stmts) {
     stmt = *stmts;
     left = mpca_grammar_find_parser(stmt->ident, st);
+    for (j = 0; j < st->parsers_num; j++) {
+      if (st->parsers[j] == left) { left->id = j; }
+    }
     if (st->flags & MPCA_LANG_PREDICTIVE) { stmt->grammar = mpc_predictive(stmt->grammar); }
     if (stmt->name) { stmt->grammar = mpc_expect(stmt->grammar, stmt->name); }
     mpc_optimise(stmt->grammar);
     mpc_define(left, stmt->grammar);
+    if (st->flags & MPCA_LANG_PACKRAT) { left->memo = 1; }
+    left->ast = st->flags & (MPCA_LANG_AST_SLICES | MPCA_LANG_AST_ARENA);
     free(stmt->ident);
     free(stmt->name);
     free(stmt);
@@ -3845,6 +6200,173 @@ mpc_err_t *mpca_lang_contents(int flags, const char *filename, ...) {
   return err;
 }
 
+/*
+** Finds the ID of the rule called `name` among
+** the parsers reachable from `p`. This walks the
+** whole grammar, so look IDs up once up front.
+*/
+
+int mpca_rule_id(mpc_parser_t *p, const char *name) {
+  int j, id = -1;
+  mpc_parser_t *q;
+  struct mpc_prog_t *prog = mpc_prog_new(p);
+  for (j = 0; j < prog->code_num; j++) {
+    q = prog->code[j].parser;
+    if (q->id >= 0 && q->name && strcmp(q->name, name) == 0) { id = q->id; break; }
+  }
+  mpc_prog_delete(prog);
+  return id;
+}
+
+/*
+** Parallel Parse
+**
+** One pass over the input counts the bracket
+** depth and cuts it into parts of about equal
+** size, each just after a whitespace character
+** at depth zero. The parts are parsed on their
+** own inputs, which start at the state of their
+** first character so positions in the tree and
+** in errors are those of the whole input.
+**
+** Parts share the processors, so there are no
+** more of them than there are processors, and
+** none shorter than `MPC_PART_MIN` bytes, which
+** take longer to start than they save.
+*/
+
+#define MPC_PART_MIN 65536
+
+typedef struct {
+  mpc_input_t *input;
+  mpc_parser_t *parser;
+  mpc_result_t result;
+  int ok;
+} mpc_part_t;
+
+static void *mpc_part_parse(void *x) {
+  mpc_part_t *t = x;
+  t->ok = mpc_parse_input(t->input, t->parser, &t->result);
+  return NULL;
+}
+
+static int mpc_parts_split(const char *string, size_t length, const char *brackets, int n, mpc_state_t *starts) {
+
+  signed char depth[256];
+  long d = 0, line = 0, row = 0;
+  size_t k, next;
+  int m = 1;
+
+  mpc_brackets_depths(depth, brackets);
+
+  starts[0] = mpc_state_new();
+  next = length / n;
+
+  for (k = 0; k < length && m < n; k++) {
+    d += depth[(unsigned char)string[k]];
+    if (string[k] == '\n') {
+      row++;
+      line = (long)k + 1;
+    }
+    if (k + 1 >= next && d == 0 && mpc_stream_space(string[k])) {
+      starts[m] = mpc_state_new();
+      starts[m].pos = (long)k + 1;
+      starts[m].row = row;
+      starts[m].col = (long)k + 1 - line;
+      m++;
+      next = length / n * m;
+    }
+  }
+
+  return m;
+}
+
+int mpca_parse_parallel(const char *filename, const char *string, size_t length, mpc_parser_t *p, const char *brackets, int n, mpc_result_t *r) {
+
+  mpc_state_t *starts;
+  mpc_part_t *parts;
+  mpc_ast_t **xs;
+  mpc_ast_store_t *s = NULL;
+  int j, m, failed;
+#ifdef MPC_THREADS
+  pthread_t *threads;
+  int *started;
+  long cores = sysconf(_SC_NPROCESSORS_ONLN);
+  if (cores > 0 && n > cores) { n = (int)cores; }
+#else
+  n = 1;
+#endif
+
+  if ((size_t)n > length / MPC_PART_MIN) { n = (int)(length / MPC_PART_MIN); }
+  if (n < 1) { n = 1; }
+  starts = malloc(sizeof(mpc_state_t) * n);
+  m = mpc_parts_split(string, length, brackets, n, starts);
+
+  parts = malloc(sizeof(mpc_part_t) * m);
+  for (j = 0; j < m; j++) {
+    parts[j].input = mpc_input_new_nstring(filename, string, j + 1 < m ? (size_t)starts[j+1].pos : length);
+    parts[j].input->origin = starts[j];
+    parts[j].input->state = starts[j];
+    parts[j].parser = p;
+  }
+
+#ifdef MPC_THREADS
+  /* memo statistics live in the shared parsers, concurrent parts leave them */
+  for (j = 0; j < m && m > 1; j++) { parts[j].input->stats = 0; }
+  threads = malloc(sizeof(pthread_t) * m);
+  started = malloc(sizeof(int) * m);
+  for (j = 1; j < m; j++) {
+    started[j] = pthread_create(&threads[j], NULL, mpc_part_parse, &parts[j]) == 0;
+  }
+  mpc_part_parse(&parts[0]);
+  for (j = 1; j < m; j++) {
+    if (started[j]) { pthread_join(threads[j], NULL); }
+    else { mpc_part_parse(&parts[j]); }
+  }
+  free(threads);
+  free(started);
+#else
+  for (j = 0; j < m; j++) { mpc_part_parse(&parts[j]); }
+#endif
+
+  /* the first error in the input is the one reported */
+  for (failed = 0; failed < m && parts[failed].ok; failed++);
+
+  xs = malloc(sizeof(mpc_ast_t*) * m);
+  for (j = 0; j < m; j++) {
+    xs[j] = parts[j].ok ? parts[j].result.output : NULL;
+    if (xs[j] == NULL) { continue; }
+    /* the stores are handed on to the stitched tree */
+    if (xs[j]->store && m > 1) {
+      xs[j]->store->next = s;
+      s = xs[j]->store;
+      xs[j]->store = NULL;
+    }
+    if (failed < m) { mpc_ast_delete(xs[j]); }
+  }
+
+  if (failed < m) {
+    r->error = parts[failed].result.error;
+    mpc_store_delete(s);
+  } else {
+    r->output = mpcf_fold_ast(m, (mpc_val_t**)xs);
+    if (s) {
+      s->root = r->output;
+      s->dirty = 1;
+      s->root->store = s;
+    }
+  }
+
+  for (j = 0; j < m; j++) {
+    if (!parts[j].ok && j != failed) { mpc_err_delete(parts[j].result.error); }
+    mpc_input_delete(parts[j].input);
+  }
+  free(xs);
+  free(parts);
+  free(starts);
+  return failed == m;
+}
+
 static int mpc_nodecount_unretained(mpc_parser_t* p, int force) {
 
   int i, total;
@@ -3856,6 +6378,7 @@ static int mpc_nodecount_unretained(mpc_parser_t* p, int force) {
   if (p->type == MPC_TYPE_APPLY)    { return 1 + mpc_nodecount_unretained(p->data.apply.x, 0); }
   if (p->type == MPC_TYPE_APPLY_TO) { return 1 + mpc_nodecount_unretained(p->data.apply_to.x, 0); }
   if (p->type == MPC_TYPE_PREDICT)  { return 1 + mpc_nodecount_unretained(p->data.predict.x, 0); }
+  if (p->type == MPC_TYPE_DFA)      { return 1 + mpc_nodecount_unretained(p->data.dfa.x, 0); }
 
   if (p->type == MPC_TYPE_CHECK)    { return 1 + mpc_nodecount_unretained(p->data.check.x, 0); }
   if (p->type == MPC_TYPE_CHECK_WITH) { return 1 + mpc_nodecount_unretained(p->data.check_with.x, 0); }
@@ -3891,6 +6414,10 @@ void mpc_stats(mpc_parser_t* p) {
   printf("Stats\n");
   printf("=====\n");
   printf("Node Count: %i\n", mpc_nodecount_unretained(p, 1));
+  if (p->memo) {
+    printf("Memo Hits: %li / %li (%.1f%%)\n", p->memo_hits, p->memo_lookups,
+      p->memo_lookups ? 100.0 * p->memo_hits / p->memo_lookups : 0.0);
+  }
 }
 
 static void mpc_optimise_unretained(mpc_parser_t *p, int force) {
@@ -3908,6 +6435,7 @@ static void mpc_optimise_unretained(mpc_parser_t *p, int force) {
   if (p->type == MPC_TYPE_CHECK)      { mpc_optimise_unretained(p->data.check.x, 0); }
   if (p->type == MPC_TYPE_CHECK_WITH) { mpc_optimise_unretained(p->data.check_with.x, 0); }
   if (p->type == MPC_TYPE_PREDICT)    { mpc_optimise_unretained(p->data.predict.x, 0); }
+  if (p->type == MPC_TYPE_DFA)        { mpc_optimise_unretained(p->data.dfa.x, 0); }
   if (p->type == MPC_TYPE_NOT)        { mpc_optimise_unretained(p->data.not.x, 0); }
   if (p->type == MPC_TYPE_MAYBE)      { mpc_optimise_unretained(p->data.not.x, 0); }
   if (p->type == MPC_TYPE_MANY)       { mpc_optimise_unretained(p->data.repeat.x, 0); }
@@ -3939,7 +6467,8 @@ static void mpc_optimise_unretained(mpc_parser_t *p, int force) {
       p->data.or.n = n + m - 1;
       p->data.or.xs = realloc(p->data.or.xs, sizeof(mpc_parser_t*) * (n + m -1));
       memmove(p->data.or.xs + n - 1, t->data.or.xs, m * sizeof(mpc_parser_t*));
-      free(t->data.or.xs); free(t->name); free(t);
+      free(p->data.or.jump); p->data.or.jump = NULL;
+      free(t->data.or.xs); free(t->data.or.jump); free(t->name); free(t);
       continue;
     }
 
@@ -3953,7 +6482,8 @@ static void mpc_optimise_unretained(mpc_parser_t *p, int force) {
       p->data.or.xs = realloc(p->data.or.xs, sizeof(mpc_parser_t*) * (n + m -1));
       memmove(p->data.or.xs + m, p->data.or.xs + 1, (n - 1) * sizeof(mpc_parser_t*));
       memmove(p->data.or.xs, t->data.or.xs, m * sizeof(mpc_parser_t*));
-      free(t->data.or.xs); free(t->name); free(t);
+      free(p->data.or.jump); p->data.or.jump = NULL;
+      free(t->data.or.xs); free(t->data.or.jump); free(t->name); free(t);
       continue;
     }
 
@@ -4066,3 +6596,160 @@ void mpc_optimise(mpc_parser_t *p) {
   mpc_optimise_unretained(p, 1);
 }
 
+/*
+** FIRST sets
+**
+** For every node reachable from the parser the
+** analysis finds the characters it can start
+** consuming with and whether it can succeed
+** without consuming anything. Both only grow,
+** so iterating until nothing changes handles
+** recursive rules.
+**
+** Each `or` of up to `MPC_JUMP_MAX` alternatives
+** then gets a table from the next character to
+** the set of alternatives worth trying. The
+** entry after the 256 characters stands for the
+** end of input, where only the alternatives that
+** can match nothing remain.
+*/
+
+typedef struct {
+  unsigned char first[32];
+  int empty;
+} mpc_first_t;
+
+static int mpc_first_union(mpc_first_t *x, mpc_first_t *y) {
+  int j, changed = 0;
+  for (j = 0; j < 32; j++) {
+    changed = changed || (x->first[j] | y->first[j]) != x->first[j];
+    x->first[j] |= y->first[j];
+  }
+  return changed;
+}
+
+static void mpc_first_node(mpc_inst_t *c, int *xs, mpc_first_t *fs, mpc_first_t *f) {
+
+  int j;
+  char x;
+
+  memset(f, 0, sizeof(mpc_first_t));
+
+  switch (c->type) {
+
+    case MPC_TYPE_ANY:
+    case MPC_TYPE_SATISFY:
+      memset(f->first, 0xFF, 32);
+      break;
+
+    case MPC_TYPE_SINGLE:
+      f->first[(unsigned char)c->data.single.x >> 3] |= 1 << ((unsigned char)c->data.single.x & 7);
+      break;
+
+    case MPC_TYPE_RANGE:
+      for (j = 0; j < 256; j++) {
+        x = (char)j;
+        if (x >= c->data.range.x && x <= c->data.range.y) { f->first[j >> 3] |= 1 << (j & 7); }
+      }
+      break;
+
+    case MPC_TYPE_ONEOF:
+    case MPC_TYPE_NONEOF:
+      memcpy(f->first, c->data.string.set, 32);
+      break;
+
+    case MPC_TYPE_STRING:
+      if (c->data.string.x[0] == '\0') { f->empty = 1; break; }
+      x = c->data.string.x[0];
+      f->first[(unsigned char)x >> 3] |= 1 << ((unsigned char)x & 7);
+      break;
+
+    case MPC_TYPE_UNDEFINED:
+    case MPC_TYPE_FAIL:
+      break;
+
+    case MPC_TYPE_APPLY:
+    case MPC_TYPE_APPLY_TO:
+    case MPC_TYPE_CHECK:
+    case MPC_TYPE_CHECK_WITH:
+    case MPC_TYPE_EXPECT:
+    case MPC_TYPE_PREDICT:
+    case MPC_TYPE_MANY1:
+    case MPC_TYPE_DFA:
+      *f = fs[xs[0]];
+      break;
+
+    case MPC_TYPE_COUNT:
+      *f = fs[xs[0]];
+      f->empty = f->empty || c->data.repeat.n <= 0;
+      break;
+
+    case MPC_TYPE_NOT:
+    case MPC_TYPE_MAYBE:
+    case MPC_TYPE_MANY:
+      *f = fs[xs[0]];
+      f->empty = 1;
+      break;
+
+    case MPC_TYPE_OR:
+      for (j = 0; j < c->n; j++) {
+        mpc_first_union(f, &fs[xs[j]]);
+        f->empty = f->empty || fs[xs[j]].empty;
+      }
+      break;
+
+    case MPC_TYPE_AND:
+      f->empty = 1;
+      for (j = 0; j < c->n && f->empty; j++) {
+        mpc_first_union(f, &fs[xs[j]]);
+        f->empty = fs[xs[j]].empty;
+      }
+      break;
+
+    /* anchors, lifts and the like consume nothing */
+    default:
+      f->empty = 1;
+      break;
+  }
+}
+
+void mpc_analyse(mpc_parser_t *p) {
+
+  int j, k, b, changed = 1;
+  unsigned long *jump;
+  mpc_first_t f, *x;
+  mpc_inst_t *c;
+  struct mpc_prog_t *prog = mpc_prog_new(p);
+  mpc_first_t *fs = calloc(prog->code_num, sizeof(mpc_first_t));
+
+  while (changed) {
+    changed = 0;
+    for (j = 0; j < prog->code_num; j++) {
+      mpc_first_node(&prog->code[j], prog->args + prog->code[j].xs, fs, &f);
+      changed = mpc_first_union(&fs[j], &f) || changed;
+      if (f.empty && !fs[j].empty) { fs[j].empty = 1; changed = 1; }
+    }
+  }
+
+  for (j = 0; j < prog->code_num; j++) {
+
+    c = &prog->code[j];
+    if (c->type != MPC_TYPE_OR || c->n < 2 || c->n > MPC_JUMP_MAX) { continue; }
+
+    jump = calloc(MPC_JUMP_EOI + 1, sizeof(unsigned long));
+    for (k = 0; k < c->n; k++) {
+      x = &fs[prog->args[c->xs + k]];
+      for (b = 0; b < 256; b++) {
+        if (x->empty || MPC_SET_HAS(x->first, b)) { jump[b] |= 1UL << k; }
+      }
+      if (x->empty) { jump[MPC_JUMP_EOI] |= 1UL << k; }
+    }
+
+    free(c->parser->data.or.jump);
+    c->parser->data.or.jump = jump;
+  }
+
+  free(fs);
+  mpc_prog_delete(prog);
+}
+
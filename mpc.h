@@ -65,12 +65,45 @@ typedef union {
 struct mpc_parser_t;
 typedef struct mpc_parser_t mpc_parser_t;
 
+/*
+** Strings are parsed in place and must outlive
+** the call. `mpc_nparse` stops at `length`, the
+** buffer needs no terminator and may contain '\0'.
+**
+** Strings, files that can be mapped, contexts
+** and streams are parsed lazily: a first pass
+** builds no errors, and only if it fails is the
+** input parsed again to report where. The
+** callbacks of `mpc_apply`, `mpc_check` and
+** their variants then run a second time for
+** the same input, so on failing input a
+** callback with side effects sees them twice.
+** Files that are read and pipes are parsed once.
+*/
+
 int mpc_parse(const char *filename, const char *string, mpc_parser_t *p, mpc_result_t *r);
 int mpc_nparse(const char *filename, const char *string, size_t length, mpc_parser_t *p, mpc_result_t *r);
 int mpc_parse_file(const char *filename, FILE *file, mpc_parser_t *p, mpc_result_t *r);
 int mpc_parse_pipe(const char *filename, FILE *pipe, mpc_parser_t *p, mpc_result_t *r);
 int mpc_parse_contents(const char *filename, mpc_parser_t *p, mpc_result_t *r);
 
+/*
+** A parse context keeps the buffers, scratch
+** memory and memo table of a parse for the next
+** one, so parsing many small inputs in a loop
+** does not set them up every time. A context can
+** only run one parse at a time.
+*/
+
+struct mpc_context_t;
+typedef struct mpc_context_t mpc_context_t;
+
+mpc_context_t *mpc_context_new(void);
+void mpc_context_delete(mpc_context_t *c);
+
+int mpc_context_parse(mpc_context_t *c, const char *filename, const char *string, mpc_parser_t *p, mpc_result_t *r);
+int mpc_context_nparse(mpc_context_t *c, const char *filename, const char *string, size_t length, mpc_parser_t *p, mpc_result_t *r);
+
 /*
 ** Function Types
 */
@@ -85,6 +118,48 @@ typedef mpc_val_t*(*mpc_fold_t)(int,mpc_val_t**);
 typedef int(*mpc_check_t)(mpc_val_t**);
 typedef int(*mpc_check_with_t)(mpc_val_t**,void*);
 
+/*
+** Parse Stream
+**
+** A stream is fed input in chunks and parses it
+** one item of `p` at a time, keeping only the
+** item being read. `mpc_stream_next` returns 1
+** with the next item. It returns 0 with an error,
+** after which everything fed so far is dropped,
+** or 0 with `r->error` NULL when it needs more
+** input, or after `mpc_stream_finish` when all
+** of it has been read.
+**
+** Whitespace between items is skipped. An item
+** that reaches the end of what has been fed may
+** go on in the next chunk, so it is deleted with
+** `da` and parsed again once more input follows.
+** Input that ends in whitespace ends the item,
+** so grammars with spaces inside their tokens
+** can't be streamed. Rows and columns count from
+** the start of the stream, positions from the
+** start of the item.
+**
+** `brackets` lists the bracket pairs of the
+** grammar, such as "(){}". An item is then only
+** parsed again once a bracket or whitespace fed
+** outside of them may have finished it, or it
+** has doubled in length, and brackets must not
+** appear inside tokens. With NULL it is parsed
+** again after every chunk, which is quadratic
+** in the length of items fed in many chunks.
+*/
+
+struct mpc_stream_t;
+typedef struct mpc_stream_t mpc_stream_t;
+
+mpc_stream_t *mpc_stream_new(const char *filename, mpc_parser_t *p, const char *brackets, mpc_dtor_t da);
+void mpc_stream_delete(mpc_stream_t *s);
+
+void mpc_stream_feed(mpc_stream_t *s, const char *data, size_t length);
+void mpc_stream_finish(mpc_stream_t *s);
+int mpc_stream_next(mpc_stream_t *s, mpc_result_t *r);
+
 /*
 ** Building a Parser
 */
@@ -127,6 +202,8 @@ mpc_parser_t *mpc_state(void);
 
 mpc_parser_t *mpc_expect(mpc_parser_t *a, const char *e);
 mpc_parser_t *mpc_expectf(mpc_parser_t *a, const char *fmt, ...);
+
+/* on input that fails to parse these callbacks may run twice, see "Parsing" */
 mpc_parser_t *mpc_apply(mpc_parser_t *a, mpc_apply_t f);
 mpc_parser_t *mpc_apply_to(mpc_parser_t *a, mpc_apply_to_t f, void *x);
 mpc_parser_t *mpc_check(mpc_parser_t *a, mpc_dtor_t da, mpc_check_t f, const char *e);
@@ -281,12 +358,56 @@ mpc_parser_t *mpc_re_mode(const char *re, int mode);
 ** AST
 */
 
+/*
+** Trees parsed by rules defined with the flag
+** MPCA_LANG_AST_SLICES share their tags, and
+** their `contents` point into the parsed string,
+** which must outlive the tree. Such contents are
+** not null terminated, so read them through
+** `length` or `mpc_ast_contents_eq`.
+**
+** With MPCA_LANG_AST_ARENA the nodes of a tree
+** are allocated together and are all released by
+** deleting its root, deleting a node inside the
+** tree frees nothing. Change such a tree only
+** through the functions below, so that nodes
+** they add are still freed with it. `flags` says
+** which parts a node doesn't own.
+**
+** Rules defined by `mpca_lang` are numbered by
+** their position among its parsers. `rules` has
+** a bit set for every rule whose name is in the
+** node's tag, as far as the IDs fit, and `rule`
+** is the ID of the innermost one, or -1.
+**
+** `refs` counts the other trees that hold the
+** node while rules defined with MPCA_LANG_PACKRAT
+** share it. Deleting such a node only drops a
+** reference, and the functions below return a
+** changed copy of it instead of changing it.
+*/
+
+enum {
+  MPC_AST_SHARED_TAG      = 1,
+  MPC_AST_SHARED_CONTENTS = 2,
+  MPC_AST_SHARED_NODE     = 4,
+  MPC_AST_SHARED_CHILDREN = 8
+};
+
+struct mpc_ast_store_t;
+
 typedef struct mpc_ast_t {
   char *tag;
   char *contents;
   mpc_state_t state;
   int children_num;
   struct mpc_ast_t** children;
+  long length;
+  int flags;
+  int refs;
+  int rule;
+  unsigned long rules;
+  struct mpc_ast_store_t *store;
 } mpc_ast_t;
 
 mpc_ast_t *mpc_ast_new(const char *tag, const char *contents);
@@ -294,10 +415,14 @@ mpc_ast_t *mpc_ast_build(int n, const char *tag, ...);
 mpc_ast_t *mpc_ast_add_root(mpc_ast_t *a);
 mpc_ast_t *mpc_ast_add_child(mpc_ast_t *r, mpc_ast_t *a);
 mpc_ast_t *mpc_ast_add_tag(mpc_ast_t *a, const char *t);
+mpc_ast_t *mpc_ast_add_rule(mpc_ast_t *a, mpc_parser_t *rule);
 mpc_ast_t *mpc_ast_add_root_tag(mpc_ast_t *a, const char *t);
 mpc_ast_t *mpc_ast_tag(mpc_ast_t *a, const char *t);
 mpc_ast_t *mpc_ast_state(mpc_ast_t *a, mpc_state_t s);
 
+long mpc_ast_contents_len(mpc_ast_t *a);
+int mpc_ast_contents_eq(mpc_ast_t *a, const char *s);
+
 void mpc_ast_delete(mpc_ast_t *a);
 void mpc_ast_print(mpc_ast_t *a);
 void mpc_ast_print_to(mpc_ast_t *a, FILE *fp);
@@ -326,6 +451,37 @@ mpc_ast_t *mpc_ast_traverse_next(mpc_ast_trav_t **trav);
 
 void mpc_ast_traverse_free(mpc_ast_trav_t **trav);
 
+/*
+** Traversal without allocations. The iterator
+** keeps its stack in `local` and only moves it to
+** the heap for trees deeper than that. Resetting
+** keeps the stack, so one iterator can walk any
+** number of trees and allocates at most a few
+** times. Release it with `mpc_ast_iter_free`.
+*/
+
+enum {
+  MPC_AST_ITER_LOCAL = 32
+};
+
+typedef struct {
+  mpc_ast_t *node;
+  int child;
+} mpc_ast_iter_frame_t;
+
+typedef struct {
+  mpc_ast_trav_order_t order;
+  int num;
+  int slots;
+  mpc_ast_iter_frame_t *stack;
+  mpc_ast_iter_frame_t local[MPC_AST_ITER_LOCAL];
+} mpc_ast_iter_t;
+
+void mpc_ast_iter_init(mpc_ast_iter_t *it, mpc_ast_t *ast, mpc_ast_trav_order_t order);
+void mpc_ast_iter_reset(mpc_ast_iter_t *it, mpc_ast_t *ast, mpc_ast_trav_order_t order);
+mpc_ast_t *mpc_ast_iter_next(mpc_ast_iter_t *it);
+void mpc_ast_iter_free(mpc_ast_iter_t *it);
+
 /*
 ** Warning: This function currently doesn't test for equality of the `state` member!
 */
@@ -340,6 +496,7 @@ mpc_parser_t *mpca_add_tag(mpc_parser_t *a, const char *t);
 mpc_parser_t *mpca_root(mpc_parser_t *a);
 mpc_parser_t *mpca_state(mpc_parser_t *a);
 mpc_parser_t *mpca_total(mpc_parser_t *a);
+mpc_parser_t *mpca_rule_tag(mpc_parser_t *a, mpc_parser_t *rule);
 
 mpc_parser_t *mpca_not(mpc_parser_t *a);
 mpc_parser_t *mpca_maybe(mpc_parser_t *a);
@@ -351,10 +508,26 @@ mpc_parser_t *mpca_count(int n, mpc_parser_t *a);
 mpc_parser_t *mpca_or(int n, ...);
 mpc_parser_t *mpca_and(int n, ...);
 
+/*
+** MPCA_LANG_PACKRAT memoises the result of every
+** rule per input position, bounding the work of
+** grammars that backtrack heavily. A hit hands
+** out the stored tree without copying it, see
+** `refs`. String inputs only, `mpc_stats`
+** reports the hit rate.
+**
+** MPCA_LANG_AST_SLICES builds trees that don't
+** copy their tags and contents, MPCA_LANG_AST_ARENA
+** trees that are freed at once, see `mpc_ast_t`.
+*/
+
 enum {
   MPCA_LANG_DEFAULT              = 0,
   MPCA_LANG_PREDICTIVE           = 1,
-  MPCA_LANG_WHITESPACE_SENSITIVE = 2
+  MPCA_LANG_WHITESPACE_SENSITIVE = 2,
+  MPCA_LANG_PACKRAT              = 4,
+  MPCA_LANG_AST_SLICES           = 8,
+  MPCA_LANG_AST_ARENA            = 16
 };
 
 mpc_parser_t *mpca_grammar(int flags, const char *grammar, ...);
@@ -364,6 +537,26 @@ mpc_err_t *mpca_lang_file(int flags, FILE *f, ...);
 mpc_err_t *mpca_lang_pipe(int flags, FILE *f, ...);
 mpc_err_t *mpca_lang_contents(int flags, const char *filename, ...);
 
+int mpca_rule_id(mpc_parser_t *p, const char *name);
+
+/*
+** Parses `string` in up to `n` parts at once and
+** stitches their trees together in order with
+** `mpcf_fold_ast`. The input is only cut after
+** whitespace outside of the bracket pairs listed
+** in `brackets`, such as "(){}", so `p` must parse
+** any run of top level items, and brackets must
+** not appear inside tokens. The parts run on their
+** own threads when built with MPC_THREADS. There
+** are never more parts than processors, nor parts
+** under 64 KB, so with one processor, short input
+** or no MPC_THREADS all of `string` is parsed at
+** once on the calling thread. An error is the one
+** of the first part that fails.
+*/
+
+int mpca_parse_parallel(const char *filename, const char *string, size_t length, mpc_parser_t *p, const char *brackets, int n, mpc_result_t *r);
+
 /*
 ** Misc
 */
@@ -371,6 +564,27 @@ mpc_err_t *mpca_lang_contents(int flags, const char *filename, ...);
 
 void mpc_print(mpc_parser_t *p);
 void mpc_optimise(mpc_parser_t *p);
+
+/*
+** Computes FIRST sets for the parser graph so
+** that each `or` only tries alternatives that
+** can start with the next character. Call it
+** once every parser it reaches is defined.
+*/
+
+void mpc_analyse(mpc_parser_t *p);
+
+/*
+** Lowers the parser graph into a flat program for
+** `mpc_parse` and friends. Parsing still starts
+** out recursive and goes on in the program once
+** the input nests deeper, so nesting is limited
+** by memory rather than the stack. The program is
+** a snapshot, so compile again after optimising,
+** analysing or redefining any parser it reaches.
+*/
+
+void mpc_compile(mpc_parser_t *p);
 void mpc_stats(mpc_parser_t *p);
 
 int mpc_test_pass(mpc_parser_t *p, const char *s, const void *d,